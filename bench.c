@@ -0,0 +1,505 @@
+#ifdef __linux__
+// For pthread_setaffinity_np.
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "queue.c"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#define DEFAULT_ITEMS 200000
+// Most item counts a single -n list may sweep.
+#define MAX_ITEM_COUNTS 8
+#define DEFAULT_REPEATS 3
+#define MAX_REPEATS 15
+// A run this much slower than its baseline, in percent, counts as a regression.
+#define DEFAULT_THRESHOLD 20.0
+#define MAX_THREADS 64
+#define MAX_BURST 16
+#define BENCH_SHARDS 4
+#define BENCH_CAPACITY 1024
+#define MAX_BASELINE_ROWS 4096
+#define BENCH_OUTPUT "bench_output.txt"
+
+// A benchmark item remembers when it was handed to the queue, so consumers can measure enqueue-to-dequeue latency.
+struct BenchItem
+{
+    uint64_t enqueued_ns;
+};
+
+// A queue configuration the sweep covers.
+struct BenchMode
+{
+    const char *name;
+    struct queue_opts opts;
+    // Only meaningful with one producer and one consumer.
+    bool one_to_one;
+};
+
+static const struct BenchMode bench_modes[] = {
+    {"mutex", {.lock_free = false}, false},
+    {"lock_free", {.lock_free = true}, false},
+    {"spsc", {.spsc = true}, true},
+    {"sharded", {.shards = BENCH_SHARDS}, false},
+    {"bounded", {.capacity = BENCH_CAPACITY}, false},
+};
+
+// One point of the sweep.
+struct BenchConfig
+{
+    const struct BenchMode *mode;
+    int producers;
+    int consumers;
+    size_t items;
+    size_t burst;
+};
+
+// Shared by the threads of one run.
+struct BenchRun
+{
+    struct BenchConfig config;
+    queue_t *queue;
+    struct BenchItem *items;
+    atomic_int ready;
+    atomic_bool go;
+    bool pin;
+};
+
+// Per-thread arguments; consumers fill in their latency samples.
+struct BenchThread
+{
+    struct BenchRun *run;
+    int index;
+    uint64_t *latencies;
+    size_t latency_count;
+};
+
+// The outcome of one run of a point.
+struct RunResult
+{
+    double ops_per_sec;
+    // p50, p99 and p999.
+    uint64_t latency_percentiles[3];
+};
+
+// Throughput of one point of a stored baseline, keyed like the output CSV.
+struct BaselineRow
+{
+    char mode[32];
+    int producers;
+    int consumers;
+    size_t items;
+    size_t burst;
+    double ops_per_sec;
+};
+
+// What the runs are checked against; empty unless -b was given.
+struct Baseline
+{
+    struct BaselineRow rows[MAX_BASELINE_ROWS];
+    size_t count;
+    double threshold;
+    int regressions;
+};
+
+int bench_producer(void *arg);
+int bench_consumer(void *arg);
+void pin_current_thread(int cpu);
+void wait_for_start(struct BenchRun *run, int index);
+int online_cpus(void);
+int compare_latencies(const void *a, const void *b);
+uint64_t percentile(const uint64_t *sorted, size_t count, double fraction);
+double run_config(const struct BenchConfig *config, bool pin, uint64_t *latency_percentiles);
+void sweep_config(const struct BenchConfig *config, bool pin, int repeats, FILE *output, struct Baseline *baseline);
+bool load_baseline(const char *path, struct Baseline *baseline);
+const struct BaselineRow *find_baseline_row(const struct Baseline *baseline, const struct BenchConfig *config);
+int compare_throughputs(const void *a, const void *b);
+
+// Sweeps every queue mode over item counts, burst sizes, and producer and consumer counts from 1 up to the number of cores; SPSC only runs its one-to-one point.
+// By default a short run, where pool growth and wake-up costs still show, is paired with a long one that measures the steady state.
+// -p pins threads to CPUs, -n sets the item counts per run as a comma-separated list, -r the runs per point (the median is reported), -c the most threads per side.
+// -b checks every point against a baseline CSV written by an earlier run, and exits with status 2 if any is more than -t percent slower.
+int main(int argc, char **argv)
+{
+    bool pin = false;
+    size_t item_counts[MAX_ITEM_COUNTS] = {DEFAULT_ITEMS / 10, DEFAULT_ITEMS};
+    size_t item_count_count = 2;
+    int repeats = DEFAULT_REPEATS;
+    int max_threads = online_cpus();
+    const char *baseline_path = NULL;
+    static struct Baseline baseline = {.threshold = DEFAULT_THRESHOLD};
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            pin = true;
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            item_count_count = 0;
+            for (char *list = argv[++i]; *list != '\0' && item_count_count < MAX_ITEM_COUNTS; list += *list == ',')
+            {
+                size_t items = strtoul(list, &list, 10);
+                if (items > 0)
+                {
+                    item_counts[item_count_count++] = items;
+                }
+                if (*list != ',' && *list != '\0')
+                {
+                    // Not a number; stop rather than loop on it.
+                    break;
+                }
+            }
+            if (item_count_count == 0)
+            {
+                fprintf(stderr, "-n needs at least one positive item count\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            repeats = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            max_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            baseline_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            baseline.threshold = strtod(argv[++i], NULL);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-p] [-n items[,items...]] [-r repeats] [-c max_threads] [-b baseline.csv] [-t percent]\n", argv[0]);
+            return 1;
+        }
+    }
+    repeats = repeats < 1 ? 1 : repeats > MAX_REPEATS ? MAX_REPEATS : repeats;
+    max_threads = max_threads < 1 ? 1 : max_threads > MAX_THREADS ? MAX_THREADS : max_threads;
+    if (baseline_path != NULL && !load_baseline(baseline_path, &baseline))
+    {
+        perror(baseline_path);
+        return 1;
+    }
+
+    FILE *output = fopen(BENCH_OUTPUT, "w");
+    if (output == NULL)
+    {
+        perror(BENCH_OUTPUT);
+        return 1;
+    }
+    fprintf(output, "mode,producers,consumers,items,burst,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+
+    // Powers of two up to the core count, and the core count itself, give the scaling curve.
+    int thread_counts[MAX_THREADS];
+    size_t thread_count_count = 0;
+    for (int threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts[thread_count_count++] = threads;
+    }
+    thread_counts[thread_count_count++] = max_threads;
+    const size_t bursts[] = {1, MAX_BURST};
+    for (size_t m = 0; m < sizeof(bench_modes) / sizeof(bench_modes[0]); m++)
+    {
+        for (size_t n = 0; n < item_count_count; n++)
+        {
+            for (size_t b = 0; b < sizeof(bursts) / sizeof(bursts[0]); b++)
+            {
+                for (size_t p = 0; p < thread_count_count; p++)
+                {
+                    for (size_t c = 0; c < thread_count_count; c++)
+                    {
+                        if (bench_modes[m].one_to_one && (thread_counts[p] != 1 || thread_counts[c] != 1))
+                        {
+                            continue;
+                        }
+                        struct BenchConfig config = {
+                            .mode = &bench_modes[m],
+                            .producers = thread_counts[p],
+                            .consumers = thread_counts[c],
+                            .items = item_counts[n],
+                            .burst = bursts[b],
+                        };
+                        sweep_config(&config, pin, repeats, output, &baseline);
+                    }
+                }
+            }
+        }
+    }
+
+    fclose(output);
+    if (baseline.regressions > 0)
+    {
+        fprintf(stderr, "%d point(s) regressed by more than %.0f%% against %s\n", baseline.regressions, baseline.threshold, baseline_path);
+        return 2;
+    }
+    return 0;
+}
+
+// Runs one point repeatedly and reports the run with the median throughput, which keeps one noisy run from failing the baseline check.
+void sweep_config(const struct BenchConfig *config, bool pin, int repeats, FILE *output, struct Baseline *baseline)
+{
+    struct RunResult results[MAX_REPEATS];
+    for (int i = 0; i < repeats; i++)
+    {
+        results[i].ops_per_sec = run_config(config, pin, results[i].latency_percentiles);
+    }
+    qsort(results, repeats, sizeof(struct RunResult), compare_throughputs);
+    const struct RunResult *median = &results[repeats / 2];
+    double seconds = config->items / median->ops_per_sec;
+    const char *mode = config->mode->name;
+
+    printf("%-9s P=%d C=%d n=%-7zu burst=%-2zu %10.0f ops/s  p50=%lluns p99=%lluns p999=%lluns", mode, config->producers, config->consumers, config->items, config->burst, median->ops_per_sec,
+           (unsigned long long)median->latency_percentiles[0], (unsigned long long)median->latency_percentiles[1], (unsigned long long)median->latency_percentiles[2]);
+    const struct BaselineRow *row = find_baseline_row(baseline, config);
+    if (row != NULL)
+    {
+        double change = (median->ops_per_sec / row->ops_per_sec - 1) * 100;
+        bool regressed = change < -baseline->threshold;
+        printf("  %+6.1f%% vs baseline%s", change, regressed ? "  REGRESSION" : "");
+        baseline->regressions += regressed;
+    }
+    printf("\n");
+    fprintf(output, "%s,%d,%d,%zu,%zu,%.6f,%.0f,%llu,%llu,%llu\n", mode, config->producers, config->consumers, config->items, config->burst, seconds, median->ops_per_sec,
+            (unsigned long long)median->latency_percentiles[0], (unsigned long long)median->latency_percentiles[1], (unsigned long long)median->latency_percentiles[2]);
+    fflush(output);
+}
+
+// Returns the throughput of one run and stores its p50, p99 and p999 latencies.
+double run_config(const struct BenchConfig *config, bool pin, uint64_t *latency_percentiles)
+{
+    struct BenchRun run = {.config = *config, .pin = pin};
+    struct queue_opts opts = config->mode->opts;
+    // Preallocation applies per shard, and a bounded queue carves out its capacity by itself.
+    opts.prealloc = opts.capacity > 0 ? 0 : config->items / (opts.shards > 1 ? opts.shards : 1);
+    run.queue = queue_create(&opts);
+    // Assuming malloc succeeds as per instructions.
+    run.items = (struct BenchItem *)malloc(config->items * sizeof(struct BenchItem));
+    atomic_init(&run.ready, 0);
+    atomic_init(&run.go, false);
+
+    struct BenchThread producers[MAX_THREADS];
+    struct BenchThread consumers[MAX_THREADS];
+    thrd_t producer_threads[MAX_THREADS];
+    thrd_t consumer_threads[MAX_THREADS];
+    for (int i = 0; i < config->consumers; i++)
+    {
+        // A consumer may end up taking every item, so each one gets room for all samples.
+        consumers[i] = (struct BenchThread){.run = &run, .index = i, .latencies = (uint64_t *)malloc(config->items * sizeof(uint64_t))};
+        thrd_create(&consumer_threads[i], bench_consumer, &consumers[i]);
+    }
+    for (int i = 0; i < config->producers; i++)
+    {
+        producers[i] = (struct BenchThread){.run = &run, .index = config->consumers + i};
+        thrd_create(&producer_threads[i], bench_producer, &producers[i]);
+    }
+
+    // Start everybody at once, so thread creation does not count towards the run.
+    while (run.ready < config->producers + config->consumers)
+    {
+        thrd_yield();
+    }
+    uint64_t start = current_time_ns();
+    run.go = true;
+    for (int i = 0; i < config->producers; i++)
+    {
+        thrd_join(producer_threads[i], NULL);
+    }
+    // Every item is queued by now, and consumers only see QUEUE_CLOSED once all shards are drained; a stop item would sit in one shard and could overtake the others.
+    queue_close(run.queue);
+    for (int i = 0; i < config->consumers; i++)
+    {
+        thrd_join(consumer_threads[i], NULL);
+    }
+    uint64_t elapsed = current_time_ns() - start;
+
+    // Merge the samples of all consumers before taking percentiles.
+    uint64_t *latencies = (uint64_t *)malloc(config->items * sizeof(uint64_t));
+    size_t count = 0;
+    for (int i = 0; i < config->consumers; i++)
+    {
+        memcpy(latencies + count, consumers[i].latencies, consumers[i].latency_count * sizeof(uint64_t));
+        count += consumers[i].latency_count;
+        free(consumers[i].latencies);
+    }
+    if (count != config->items)
+    {
+        fprintf(stderr, "%s P=%d C=%d: consumed %zu of %zu items\n", config->mode->name, config->producers, config->consumers, count, config->items);
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+
+    latency_percentiles[0] = percentile(latencies, count, 0.50);
+    latency_percentiles[1] = percentile(latencies, count, 0.99);
+    latency_percentiles[2] = percentile(latencies, count, 0.999);
+
+    free(latencies);
+    free(run.items);
+    queue_destroy(run.queue);
+    // Throughput counts what consumers actually took, one sample each.
+    return count / (elapsed / 1e9);
+}
+
+int bench_producer(void *arg)
+{
+    struct BenchThread *self = (struct BenchThread *)arg;
+    struct BenchRun *run = self->run;
+    const struct BenchConfig *config = &run->config;
+    int producer = self->index - config->consumers;
+    // Items are split evenly; the last producer takes the remainder.
+    size_t share = config->items / config->producers;
+    size_t first = producer * share;
+    size_t last = producer == config->producers - 1 ? config->items : first + share;
+    void *burst[MAX_BURST];
+    wait_for_start(run, self->index);
+
+    for (size_t i = first; i < last;)
+    {
+        size_t count = last - i < config->burst ? last - i : config->burst;
+        for (size_t j = 0; j < count; j++)
+        {
+            burst[j] = &run->items[i + j];
+            run->items[i + j].enqueued_ns = current_time_ns();
+        }
+        if (count == 1)
+        {
+            queue_enqueue(run->queue, burst[0]);
+        }
+        else
+        {
+            queue_enqueue_many(run->queue, burst, count);
+        }
+        i += count;
+    }
+    return 0;
+}
+
+int bench_consumer(void *arg)
+{
+    struct BenchThread *self = (struct BenchThread *)arg;
+    struct BenchRun *run = self->run;
+    wait_for_start(run, self->index);
+
+    while (true)
+    {
+        struct BenchItem *item = (struct BenchItem *)queue_dequeue(run->queue);
+        if (item == QUEUE_CLOSED)
+        {
+            return 0;
+        }
+        self->latencies[self->latency_count++] = current_time_ns() - item->enqueued_ns;
+    }
+}
+
+void wait_for_start(struct BenchRun *run, int index)
+{
+    if (run->pin)
+    {
+        pin_current_thread(index);
+    }
+    run->ready++;
+    while (!run->go)
+    {
+        thrd_yield();
+    }
+}
+
+// Pinning spreads threads over the available CPUs round-robin; it is a no-op where affinity is not supported.
+void pin_current_thread(int cpu)
+{
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (cpus > 0 ? cpus : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+// The sweep's upper thread count when -c is not given.
+int online_cpus(void)
+{
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#else
+    return 8;
+#endif
+}
+
+// Reads the ops_per_sec column of a CSV written by an earlier sweep; points it does not contain are not checked.
+bool load_baseline(const char *path, struct Baseline *baseline)
+{
+    FILE *input = fopen(path, "r");
+    if (input == NULL)
+    {
+        return false;
+    }
+    char line[256];
+    // Skip the header.
+    if (fgets(line, sizeof(line), input) == NULL)
+    {
+        fclose(input);
+        return true;
+    }
+    while (baseline->count < MAX_BASELINE_ROWS && fgets(line, sizeof(line), input) != NULL)
+    {
+        struct BaselineRow *row = &baseline->rows[baseline->count];
+        double seconds;
+        if (sscanf(line, "%31[^,],%d,%d,%zu,%zu,%lf,%lf", row->mode, &row->producers, &row->consumers, &row->items, &row->burst, &seconds, &row->ops_per_sec) == 7 && row->ops_per_sec > 0)
+        {
+            baseline->count++;
+        }
+    }
+    fclose(input);
+    return true;
+}
+
+const struct BaselineRow *find_baseline_row(const struct Baseline *baseline, const struct BenchConfig *config)
+{
+    for (size_t i = 0; i < baseline->count; i++)
+    {
+        const struct BaselineRow *row = &baseline->rows[i];
+        if (strcmp(row->mode, config->mode->name) == 0 && row->producers == config->producers && row->consumers == config->consumers && row->items == config->items && row->burst == config->burst)
+        {
+            return row;
+        }
+    }
+    return NULL;
+}
+
+int compare_throughputs(const void *a, const void *b)
+{
+    double left = ((const struct RunResult *)a)->ops_per_sec;
+    double right = ((const struct RunResult *)b)->ops_per_sec;
+    return (left > right) - (left < right);
+}
+
+int compare_latencies(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
+}
+
+uint64_t percentile(const uint64_t *sorted, size_t count, double fraction)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (count - 1));
+    return sorted[index];
+}
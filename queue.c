@@ -1,8 +1,139 @@
 #include "queue.h"
 #include <threads.h>
 #include <stdatomic.h>
+#include <stdalign.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+// The pollable notifier is an eventfd on Linux and a self-pipe on other POSIX systems; elsewhere queue_notify_fd reports -1.
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+// <sched.h> only declares it under _GNU_SOURCE, which callers would have to define before their first libc include.
+int getcpu(unsigned int *cpu, unsigned int *node);
+#define QUEUE_HAVE_GETCPU
+#endif
+#ifdef QUEUE_HAVE_SHM
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+// POSIX.1-2001, but strict C modes leave it out of <unistd.h>.
+int ftruncate(int fd, off_t length);
+#if defined(__linux__)
+// Robust mutexes survive a process that dies holding them. Strict C modes hide these too, and glibc makes PTHREAD_MUTEX_ROBUST an enumerator, so its value is spelled out; glibc and musl agree on it.
+int pthread_mutexattr_setrobust(pthread_mutexattr_t *attr, int robustness);
+int pthread_mutex_consistent(pthread_mutex_t *mutex);
+#define SHM_MUTEX_ROBUST 1
+#define QUEUE_HAVE_ROBUST_MUTEX
+#endif
+#endif
 
+// Pooled nodes are addressed by a 32-bit index into a chunked arena, so free-list and lock-free head/tail words can pair the index with a 32-bit ABA tag in a single 64-bit CAS.
+#define NODE_POOL_NULL_INDEX UINT32_MAX
+// Chunk k holds 2^(NODE_POOL_FIRST_CHUNK_SHIFT + k) nodes; the arena doubles on each growth and the last chunk keeps every index below NODE_POOL_NULL_INDEX.
+#define NODE_POOL_FIRST_CHUNK_SHIFT 6
+#define NODE_POOL_MAX_CHUNKS 26
+// Thread caches move nodes to and from the central free list this many at a time, and hold at most twice as many.
+#define NODE_CACHE_BATCH 32
+// Number of pools a thread can cache nodes for at once; a power of two, so consecutive pool ids map to distinct slots.
+#define NODE_CACHE_SLOTS 64
+// Blocking consumers spin for at most this multiple of the mean inter-arrival time before parking.
+#define SPIN_BUDGET_FACTOR 2
+// Longest run of pause instructions between two polls of the queue size.
+#define SPIN_MAX_BACKOFF 64
+#define CACHE_LINE_SIZE 64
+// Fields written by producers, by consumers, and by everyone start on separate cache lines; build with -DQUEUE_COMPACT_LAYOUT to pack them instead.
+#ifdef QUEUE_COMPACT_LAYOUT
+#define CACHE_ALIGNED
+#else
+#define CACHE_ALIGNED alignas(CACHE_LINE_SIZE)
+#endif
+// How far down the line of waiters a producer on a NUMA-aware queue looks for one on its own node, and how often the first waiter may be passed over that way.
+#define NUMA_WAKE_WINDOW 4
+// Attempts a lock-free peek makes at a stable snapshot, halving how far it walks after each one the consumers invalidate.
+#define LOCK_FREE_PEEK_ATTEMPTS 16
+// Marks a shared-memory queue segment whose creator has finished initializing it.
+#define SHM_QUEUE_MAGIC 0x5155455545534d31ull
+// How long attaching waits for the creator to size and initialize a segment before giving up on it.
+#define SHM_ATTACH_TIMEOUT_NS 1000000000ull
+// Slots per segment of the single-producer/single-consumer ring.
+#define SPSC_SEGMENT_SLOTS 1024
+// Number of cache lines per-thread statistics are spread over; threads beyond that share stripes round-robin.
+#define STATS_STRIPES 16
+// Build with -DQUEUE_STATS to count lock contention, parking and residency on the hot paths; queueStats reports zeros for them otherwise.
+#ifdef QUEUE_STATS
+#define QUEUE_COUNT(q, counter, n) atomic_fetch_add_explicit(&(q)->counters.counter, (n), memory_order_relaxed)
+#define STAMP_ENQUEUE(node) ((node)->enqueued_ns = current_time_ns())
+#define RECORD_RESIDENCY(q, enqueued) record_residency((q), (enqueued))
+#define RECORD_SHARD_DEQUEUE(q, home, remote, n) record_shard_dequeue((q), (home), (remote), (n))
+#else
+#define QUEUE_COUNT(q, counter, n) ((void)0)
+#define STAMP_ENQUEUE(node) ((void)0)
+#define RECORD_RESIDENCY(q, enqueued) ((void)0)
+#define RECORD_SHARD_DEQUEUE(q, home, remote, n) ((void)0)
+#endif
+
+// Header at the start of every pooled node: its own index, and its successor while it sits on a free list.
+struct PoolLink
+{
+    uint32_t index;
+    // Atomic because a thread popping the central free list may read it from a node that was just handed out.
+    _Atomic uint32_t free_next;
+};
+
+// Central slab of equally sized nodes. Chunks go back to the allocator only when the pool is destroyed, which keeps recycled nodes readable for the lock-free path.
+struct NodePool
+{
+    size_t node_size;
+    // Treiber stack of free nodes, as a tagged index.
+    _Atomic uint64_t free_list;
+    char *_Atomic chunks[NODE_POOL_MAX_CHUNKS];
+    unsigned chunk_count;
+    // Serializes growth only; acquire and release never take it in steady state.
+    mtx_t grow_lock;
+    // Unique over the process lifetime, so thread caches can tell a pool from an earlier one at the same address.
+    uint64_t id;
+    // Link in the registry of live pools that departing threads flush their caches into.
+    struct NodePool *next_live;
+    // Nodes still to carve out when the pool first runs dry, or a consumer on the shard's node claims them, so the thread that first touches them is one that uses them.
+    atomic_size_t deferred_prealloc;
+};
+
+// Per-thread stash of free nodes from one pool, chained through PoolLink.free_next, so steady-state acquire and release touch no shared state.
+struct NodeCache
+{
+    uint64_t pool_id;
+    uint32_t head;
+    uint32_t tail;
+    unsigned count;
+    // Calls for other pools mapping to this slot since pool_id was last used.
+    unsigned misses;
+};
+
+// Everything a thread keeps across queue operations; a tss destructor releases it when the thread exits.
+struct ThreadState
+{
+    struct NodeCache node_caches[NODE_CACHE_SLOTS];
+    // Shared by every ThreadNode of this thread and initialized on first park, so blocking costs no cnd_init.
+    cnd_t wake_condition;
+    bool wake_condition_ready;
+    bool registered;
+    // One past the thread's round-robin number, or 0 before it first needed one.
+    unsigned ordinal;
+    // Queue whose dequeueAsync callbacks this thread is running, so a callback that asks for the next item does not recurse.
+    struct queue *completing_queue;
+    // Buffer of the queue_dequeue_copy this thread is inside, which unwrap_data_node fills instead of allocating a copy.
+    void *copy_destination;
+};
 
 // Manages a collection of thread entries, tracking the first and last entries and the count of entries awaiting processing.
 struct QueueOfThreads
@@ -13,315 +144,3605 @@ struct QueueOfThreads
 };
 
 // Represents a single thread entry in the queue, including its unique ID, next node, condition variable, termination status, and wait condition.
+// Nodes live on the blocked thread's stack for the duration of its wait, so parking never allocates.
 struct ThreadNode
 {
     thrd_t thread_id;
     struct ThreadNode *next_node;
-    // Unique condition variable for each thread to enable specific signaling.
-    cnd_t condition_var;
+    // Back link, so a waiter can leave the queue from any position in O(1).
+    struct ThreadNode *prev_node;
+    // Unique condition variable for each thread to enable specific signaling; owned by the thread's ThreadState.
+    cnd_t *condition_var;
     bool is_terminated;
-    int waiting_for;
+    // Set by the signaller and cleared by the waiter once it holds the lock again, so a wakeup already on its way is not sent twice.
+    bool wake_pending;
+    // Set when a producer handed an item straight to this waiter, and already took it out of line.
+    bool has_handoff;
+    void *handoff;
+    // Sequence number of the item this waiter is entitled to once it is the oldest one queued.
+    uint64_t waiting_for;
+    // NUMA node the waiter parked on; only tracked by NUMA-aware queues.
+    unsigned numa_node;
+    // Set when a producer on the same node woke this waiter ahead of its turn, which lets it take one item without being first.
+    bool woken_out_of_turn;
+    // Times later waiters were woken ahead of this one; NUMA_WAKE_WINDOW of them and it is not skipped again.
+    unsigned overtaken;
+};
+
+// A FIFO list of data nodes that share one priority.
+struct DataLane
+{
+    struct queue_link *first;
+    struct queue_link *last;
 };
 
 // Queue structure for data elements, including pointers to the first and last elements, and counters for size, processed, and added elements.
 struct QueueOfData
 {
-    struct DataNode *first;
-    struct DataNode *last;
-    atomic_ulong size;
-    atomic_ulong processed_count;
-    atomic_ulong added_count;
+    // Consumer side.
+    CACHE_ALIGNED struct queue_link *first;
+    atomic_ullong processed_count;
+    // Producer side.
+    CACHE_ALIGNED struct queue_link *last;
+    // Less size, the number of items taken so far, which waiter tickets count in; 64 bits, so it does not wrap within a process lifetime, and comparisons are wrap-safe regardless.
+    atomic_ullong added_count;
+    // Shared by both sides.
+    CACHE_ALIGNED atomic_ullong size;
     mtx_t lock;
+    // Lanes for queue_enqueue_priority, most urgent last; first/last above are the default lane.
+    struct DataLane priority_lanes[QUEUE_PRIORITY_LANES - 1];
+    // Bit i is set while priority_lanes[i] holds items, so the most urgent one is found without a scan.
+    unsigned lane_mask;
 };
 
 // Represents a single data element within the data queue, including a pointer to the next element, an index, and the data pointer itself.
 struct DataNode
 {
-    struct DataNode *next_node;
-    int data_index;
+    struct PoolLink link;
+    // Its place in the data queue, which caller-owned links from queue_enqueue_node share with these wrappers.
+    struct queue_link entry;
     void *data_ptr;
+    // Queued by queue_enqueue_copy: the item is the payload below rather than data_ptr.
+    bool inline_payload;
+#ifdef QUEUE_STATS
+    uint64_t enqueued_ns;
+#endif
+    // queue_opts.inline_size bytes on queues that take copies.
+    unsigned char payload[];
+};
+
+// A node of the lock-free data path. Racing threads may read it after it was recycled; the tags make their CAS fail.
+struct LockFreeNode
+{
+    struct PoolLink link;
+    // Tagged index of the successor in the Michael-Scott list.
+    _Atomic uint64_t next;
+    // Read by dequeuers before their head CAS, possibly after the node was recycled, hence atomic.
+    _Atomic(void *) data_ptr;
+    // Set when data_ptr is a heap box queued by queue_enqueue_copy; read alongside data_ptr.
+    _Atomic bool boxed;
+#ifdef QUEUE_STATS
+    // Read before the head CAS for the same reason as data_ptr.
+    _Atomic uint64_t enqueued_ns;
+#endif
+};
+
+// Michael-Scott queue with a dummy head node; its nodes come from node_pool.
+struct LockFreeQueue
+{
+    CACHE_ALIGNED _Atomic uint64_t head;
+    CACHE_ALIGNED _Atomic uint64_t tail;
+};
+
+// A block of SPSC slots. The producer links a new one when its block fills up, so the queue stays unbounded, and the consumer hands drained blocks back as spares.
+struct SpscSegment
+{
+    _Atomic(struct SpscSegment *) next;
+    void *slots[SPSC_SEGMENT_SLOTS];
+    // queue_opts.inline_size bytes per slot on queues that take copies; a slot that points at its own payload holds a copy.
+    unsigned char payloads[];
+};
+
+// Single-producer/single-consumer queue: each side owns its position and only publishes it with a release store, so neither ever waits on the other.
+struct SpscQueue
+{
+    // Consumer side; head counts the items taken so far.
+    CACHE_ALIGNED struct SpscSegment *read_segment;
+    atomic_size_t head;
+    // Last tail the consumer saw, so it only reads the producer's line once that many items are used up.
+    size_t cached_tail;
+    // Producer side; tail counts the items published so far.
+    CACHE_ALIGNED struct SpscSegment *write_segment;
+    atomic_size_t tail;
+    // A drained segment kept for reuse, which makes the steady state a ring of segments without allocation.
+    CACHE_ALIGNED _Atomic(struct SpscSegment *) spare;
+};
+
+// Backpressure for bounded queues: producers reserve a slot before adding an item, and park in line while none is free.
+struct CapacityLimit
+{
+    // 0 leaves the queue unbounded and skips all slot accounting.
+    size_t capacity;
+    // Reserved by producers and returned by consumers, from either side of the lock.
+    CACHE_ALIGNED atomic_ulong free_slots;
+    struct QueueOfThreads producer_queue;
+};
+
+#ifdef QUEUE_STATS
+// Hot-path counters; relaxed, since they only feed queueStats snapshots.
+struct QueueCounters
+{
+    CACHE_ALIGNED atomic_ullong lock_acquisitions;
+    atomic_ullong contended_acquisitions;
+    atomic_ullong waits;
+    atomic_ullong spurious_wakeups;
+    atomic_ullong parked_ns;
+    atomic_ullong residency_samples;
+    atomic_ullong residency_ns;
+    atomic_ullong numa_local_dequeues[QUEUE_MAX_NUMA_NODES];
+    atomic_ullong numa_remote_dequeues[QUEUE_MAX_NUMA_NODES];
+};
+#endif
+
+// One cache line of a queue's per-thread statistics; readers add up all stripes.
+struct StatsStripe
+{
+    alignas(CACHE_LINE_SIZE) atomic_ulong added_count;
+    atomic_ulong processed_count;
+};
+
+// How many consumers of a NUMA-aware queue are inside a dequeue on one node; a line per node, since every dequeue writes it.
+struct NodeConsumers
+{
+    CACHE_ALIGNED atomic_size_t active;
+};
+
+// Spin-before-park tuning: producers stamp arrivals, and consumers spin only while an item is due sooner than a futex round trip would deliver it.
+struct SpinPolicy
+{
+    // Ceiling from queue_opts.spin_ns; 0 disables spinning and arrival tracking.
+    uint64_t max_spin_ns;
+    _Atomic uint64_t last_arrival_ns;
+    // Moving average of the gap between enqueued items. Updated without synchronization, since the budget only needs an estimate.
+    _Atomic uint64_t mean_interarrival_ns;
+};
+
+// Readiness handle for event loops: readable once an item arrives after the last rearm, however many follow.
+struct Notifier
+{
+    // Both -1 unless queue_opts.pollable is set; an eventfd uses the same descriptor for both ends.
+    int read_fd;
+    int write_fd;
+    // Set by the first producer after a rearm, so the others skip the write.
+    atomic_bool signalled;
+};
+
+// A dequeueAsync call still waiting for its item. It outlives the call, so unlike a ThreadNode it cannot sit on the caller's stack.
+struct AsyncWaiter
+{
+    struct AsyncWaiter *next;
+    void (*callback)(void *item, void *ctx);
+    void *ctx;
+};
+
+// dequeueAsync calls served oldest first by whichever thread makes an item available; they hold no ticket, so they take items like tryDequeue.
+struct AsyncWaiters
+{
+    mtx_t lock;
+    struct AsyncWaiter *first;
+    struct AsyncWaiter *last;
+    // Polled by every enqueue without the lock; the registration and the item pushes are sequentially consistent, like count_of_waiting_threads.
+    atomic_size_t count;
+};
+
+// One independent queue instance: its waiters, its data, and the pool its nodes come from.
+struct queue
+{
+    // Its waiter count is polled by every lock-free enqueue, so it gets a line of its own.
+    CACHE_ALIGNED struct QueueOfThreads thread_queue;
+    struct QueueOfData data_queue;
+    struct LockFreeQueue lock_free_queue;
+    struct SpscQueue spsc_queue;
+    CACHE_ALIGNED struct NodePool node_pool;
+    struct SpinPolicy spin_policy;
+    struct CapacityLimit capacity_limit;
+    struct Notifier notifier;
+    struct AsyncWaiters async_waiters;
+    // NULL unless queue_opts.per_thread_stats is set.
+    struct StatsStripe *stats_stripes;
+    // Sub-queues of a sharded queue, or NULL. They hold all items, while this queue only parks consumers.
+    struct queue *shards;
+    size_t shard_count;
+    // Shard i belongs to NUMA node i % numa_nodes; 0 when the queue ignores topology.
+    size_t numa_nodes;
+    // numa_nodes entries of consumers inside a dequeue on each node, or NULL when the queue ignores topology.
+    struct NodeConsumers *node_consumers;
+#ifdef QUEUE_STATS
+    struct QueueCounters counters;
+#endif
+    bool use_lock_free;
+    bool use_spsc;
+    // queue_opts.wakeup is QUEUE_BARGING.
+    bool barging;
+    // queue_opts.inline_size.
+    size_t inline_size;
+    // Set once by queue_close; producers read it without the lock, consumers under it.
+    atomic_bool closed;
+    // Lock-free, SPSC and sharded producers between their closed check and their push; the queue is only drained once this is 0 as well.
+    atomic_size_t producers_in_flight;
+    thrd_t terminator;
+};
+
+#ifdef QUEUE_HAVE_SHM
+// Start of a shared-memory queue segment. Processes map it at different addresses, so it holds no pointers: slot i sits at slots_offset + i * slot_stride from the header.
+struct ShmQueueHeader
+{
+    // Becomes SHM_QUEUE_MAGIC once the creator has initialized everything below; attaching processes wait for it, up to SHM_ATTACH_TIMEOUT_NS.
+    atomic_ullong magic;
+    size_t capacity;
+    size_t slot_size;
+    size_t slot_stride;
+    size_t slots_offset;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    // Items taken and items stored so far, guarded by lock like closed; position p lives in slot p % capacity.
+    // Each critical section publishes with one store to one of them, so a process that dies holding the lock never leaves them disagreeing.
+    size_t head;
+    size_t tail;
+    bool closed;
 };
 
+// One process's view of a shared-memory queue.
+struct queue_shm
+{
+    struct ShmQueueHeader *header;
+    size_t mapped_size;
+};
+#endif
 
+// Backs the original, handle-less API.
+static struct queue default_queue;
 
-static struct QueueOfThreads thread_queue;
-static struct QueueOfData data_queue;
-static thrd_t terminator;
+// Its address is QUEUE_CLOSED; it is never linked into a queue.
+struct queue_link queue_closed_link;
 
+static struct NodePool *live_pools;
+static mtx_t live_pools_lock;
+static once_flag live_pools_once = ONCE_FLAG_INIT;
+static atomic_ullong last_pool_id;
+static atomic_uint last_thread_ordinal;
+static tss_t thread_state_key;
+static thread_local struct ThreadState thread_state;
 
-void clear_all_data_nodes(void);
-void dismantle_queue_of_threads(void);
-struct DataNode *initialize_data_node(void *data);
-void insert_node_into_data_queue(struct DataNode *node_to_add);
-void insert_node_into_empty_data_queue(struct DataNode *node_to_add);
-void insert_node_into_nonempty_data_queue(struct DataNode *node_to_add);
-bool should_current_thread_yield(void);
-void enqueue_thread_node(void);
-void dequeue_thread_node(void);
-void insert_node_into_thread_queue(struct ThreadNode *node_to_add);
-void insert_node_into_empty_thread_queue(struct ThreadNode *node_to_add);
-void insert_node_into_nonempty_thread_queue(struct ThreadNode *node_to_add);
-struct ThreadNode *initialize_thread_node(void);
-int retrieve_first_waiting_status(void);
+
+void queue_init(struct queue *q, const struct queue_opts *opts);
+void queue_fini(struct queue *q);
+void clear_all_data_nodes(struct queue *q);
+void free_lock_free_boxes(struct queue *q);
+void dismantle_queue_of_threads(struct queue *q);
+struct DataNode *initialize_data_node(struct queue *q, void *data);
+void insert_node_into_data_queue(struct queue *q, struct queue_link *node_to_add);
+void insert_node_into_empty_data_queue(struct queue *q, struct queue_link *node_to_add);
+void insert_node_into_nonempty_data_queue(struct queue *q, struct queue_link *node_to_add);
+bool should_current_thread_yield(struct queue *q, struct ThreadNode *current);
+void enqueue_thread_node(struct queue *q, struct ThreadNode *node_to_add);
+void dequeue_thread_node(struct QueueOfThreads *threads, struct ThreadNode *node_to_remove);
+void insert_node_into_thread_queue(struct QueueOfThreads *threads, struct ThreadNode *node_to_add);
+void insert_node_into_empty_thread_queue(struct QueueOfThreads *threads, struct ThreadNode *node_to_add);
+void insert_node_into_nonempty_thread_queue(struct QueueOfThreads *threads, struct ThreadNode *node_to_add);
+void terminate_thread_list(struct QueueOfThreads *threads);
+void initialize_thread_node(struct queue *q, struct ThreadNode *thread_node);
+void initialize_live_pools(void);
+void initialize_node_pool(struct NodePool *pool, size_t node_size, size_t prealloc);
+void destroy_node_pool(struct NodePool *pool);
+struct PoolLink *pool_node_at(struct NodePool *pool, uint32_t index);
+bool pop_central_node(struct NodePool *pool, uint32_t *index);
+void push_central_chain(struct NodePool *pool, uint32_t first, struct PoolLink *last);
+void add_node_pool_chunk(struct NodePool *pool);
+void carve_node_pool(struct NodePool *pool, size_t prealloc);
+void grow_node_pool(struct NodePool *pool);
+struct NodeCache *node_cache_for(struct NodePool *pool);
+void refill_node_cache(struct NodePool *pool, struct NodeCache *cache);
+void flush_node_cache(struct NodeCache *cache);
+void register_thread_state(void);
+void release_thread_state(void *state);
+cnd_t *current_wake_condition(void);
+struct PoolLink *acquire_pool_node(struct NodePool *pool);
+void release_pool_node(struct NodePool *pool, struct PoolLink *node);
+void initialize_lock_free_queue(struct queue *q);
+struct LockFreeNode *lock_free_node_at(struct queue *q, uint32_t index);
+void lock_free_push(struct queue *q, void **items, size_t count, bool boxed);
+void wake_first_waiter(struct queue *q);
+void initialize_spsc_queue(struct queue *q);
+void destroy_spsc_queue(struct queue *q);
+void spsc_push(struct queue *q, void **items, size_t count);
+void spsc_push_copy(struct queue *q, const void *item, size_t size);
+struct SpscSegment *allocate_spsc_segment(struct queue *q);
+void **claim_spsc_slot(struct queue *q, size_t tail);
+unsigned char *spsc_payload(struct queue *q, struct SpscSegment *segment, size_t slot);
+bool spsc_pop(struct queue *q, void **data);
+size_t spsc_size(struct queue *q);
+void signal_thread_node(struct ThreadNode *node);
+void splice_chain_into_data_queue(struct queue *q, struct queue_link *chain_first, struct queue_link *chain_last, size_t count);
+void insert_node_into_priority_lane(struct queue *q, struct queue_link *node_to_add, int lane);
+struct queue_link *pop_data_node(struct queue *q);
+void *unwrap_data_node(struct queue *q, struct queue_link *entry);
+void *copy_inline_payload(struct queue *q, const unsigned char *payload);
+void *unbox_inline_payload(struct queue *q, void *box);
+uint64_t taken_data_count(struct queue *q);
+bool sequence_before(uint64_t a, uint64_t b);
+void wake_data_waiters(struct queue *q, size_t count);
+void release_closed_waiters(struct queue *q);
+bool hand_off_to_waiter(struct queue *q, void *data);
+size_t detach_available_items(struct queue *q, void **out, size_t max);
+size_t detach_data_lanes(struct queue *q, struct DataLane *lanes);
+void return_data_lanes(struct queue *q, struct DataLane *lanes, size_t count);
+bool deliver_drained_batch(struct queue *q, int (*fn)(void **, size_t, void *), void *ctx, void **batch, size_t count, size_t released);
+bool lock_free_pop(struct queue *q, void **data);
+bool dequeue_with_lock(struct queue *q, const struct timespec *deadline, void **out);
+bool dequeue_lock_free(struct queue *q, const struct timespec *deadline, void **out);
+int wait_on_thread_node(struct queue *q, struct ThreadNode *node, const struct timespec *deadline);
+void withdraw_thread_node(struct queue *q, struct ThreadNode *node);
+uint64_t current_time_ns(void);
+void cpu_relax(void);
+void record_arrival(struct queue *q, size_t count);
+uint64_t spin_budget_ns(struct queue *q);
+void spin_for_item(struct queue *q);
+bool has_pending_items(struct queue *q);
+bool lock_free_has_items(struct queue *q);
+struct StatsStripe *stats_stripe_for(struct queue *q);
+void count_processed(struct queue *q, size_t count);
+void count_lock_free_added(struct queue *q, size_t count);
+void count_lock_free_taken(struct queue *q, size_t count);
+void advance_locked_counter(atomic_ullong *counter, unsigned long long count);
+void retreat_locked_counter(atomic_ullong *counter, unsigned long long count);
+bool append_item(struct queue *q, void *element_data);
+bool append_items(struct queue *q, void **items, size_t count);
+bool append_in_pieces(struct queue *q, void **items, size_t count);
+bool append_copy(struct queue *q, const void *item, size_t size);
+bool enter_enqueue(struct queue *q);
+void leave_enqueue(struct queue *q);
+bool closed_and_drained(struct queue *q);
+bool refuse_closed_enqueue(struct queue *q, size_t count);
+bool take_available_item(struct queue *q, void **element);
+size_t peek_data_lanes(struct queue *q, void **out, size_t max);
+size_t lock_free_peek(struct queue *q, void **out, size_t max);
+size_t spsc_peek(struct queue *q, void **out, size_t max);
+bool reserve_slots(struct queue *q, size_t count);
+bool acquire_slots(struct queue *q, size_t count);
+void release_slots(struct queue *q, size_t count);
+void lock_data_queue(struct queue *q);
+unsigned thread_ordinal(void);
+bool pop_available(struct queue *q, void **data);
+struct queue *home_shard(struct queue *q);
+struct queue *producer_shard(struct queue *q);
+struct queue *shard_on_node(struct queue *q, size_t node);
+size_t enter_consumer_node(struct queue *q);
+void leave_consumer_node(struct queue *q, size_t node);
+void carve_deferred_nodes(struct NodePool *pool);
+bool take_from_shards(struct queue *q, void **data);
+bool enqueue_into_shard(struct queue *q, void **items, size_t count);
+void initialize_shards(struct queue *q, const struct queue_opts *opts);
+void initialize_notifier(struct queue *q, bool pollable);
+void destroy_notifier(struct queue *q);
+void signal_notifier(struct queue *q);
+void complete_async_waiters(struct queue *q);
+void cancel_async_waiters(struct queue *q);
+unsigned current_numa_node(void);
+bool shard_is_local(struct queue *q, size_t shard, size_t home);
+struct ThreadNode *nearest_waiter(struct queue *q);
+bool may_take_item(struct queue *q, struct ThreadNode *node);
+#ifdef QUEUE_STATS
+void record_residency(struct queue *q, uint64_t enqueued_ns);
+void record_shard_dequeue(struct queue *q, size_t home, bool remote, size_t count);
+#endif
+#ifdef QUEUE_HAVE_SHM
+void initialize_shm_header(struct ShmQueueHeader *header, size_t capacity, size_t slot_size, size_t slot_stride, size_t slots_offset);
+struct ShmQueueHeader *attach_shm_header(int fd, size_t *mapped_size);
+char *shm_slot(struct ShmQueueHeader *header, size_t index);
+bool put_shm_item(struct ShmQueueHeader *header, const void *item, bool block);
+bool take_shm_item(struct ShmQueueHeader *header, const struct timespec *deadline, void *out, bool block);
+void lock_shm_header(struct ShmQueueHeader *header);
+int recover_shm_lock(struct ShmQueueHeader *header, int result);
+#endif
 
 
 void initQueue(void)
 {
-    // Initialize data queue pointers to null, indicating an empty queue.
-    data_queue.first = NULL;
-    data_queue.last = NULL;
-    // Reset all data queue counters to 0, reflecting an empty state.
-    data_queue.size = 0;
-    data_queue.processed_count = 0;
-    data_queue.added_count = 0;
-    // Initialize the mutex lock for data queue operations.
-    mtx_init(&data_queue.lock, mtx_plain);
-    
-    // Initialize thread queue pointers to null, showing no threads are queued.
-    thread_queue.first = NULL;
-    thread_queue.last = NULL;
-    // Reset the count of waiting threads to 0.
-    thread_queue.count_of_waiting_threads = 0;
+    queue_init(&default_queue, NULL);
+}
+
+void initQueueWithOpts(const struct queue_opts *opts)
+{
+    queue_init(&default_queue, opts);
 }
 
 void destroyQueue(void)
 {
-    // Acquire the lock on the data queue to ensure exclusive access.
-    mtx_lock(&data_queue.lock);
-    // Clear all nodes from the data queue safely.
-    clear_all_data_nodes();
-    // Dismantle the thread queue, ensuring all thread nodes are properly managed.
-    dismantle_queue_of_threads();
-    // Release the lock after operations are completed.
-    mtx_unlock(&data_queue.lock);
-    // Destroy the mutex lock, as the data queue will no longer be in use.
-    mtx_destroy(&data_queue.lock);
+    queue_fini(&default_queue);
 }
 
-void clear_all_data_nodes(void)
+void closeQueue(void)
 {
-    struct DataNode *previous_node;
-    while (data_queue.first != NULL)
-    {
-        previous_node = data_queue.first;
-        data_queue.first = previous_node->next_node;
-        free(previous_node);
-    }
-    // Although resetting these fields might not be strictly necessary, it ensures the data queue is in a clean state.
-    data_queue.last = NULL;
-    data_queue.size = 0;
-    data_queue.processed_count = 0;
-    data_queue.added_count = 0;
+    queue_close(&default_queue);
 }
 
-void dismantle_queue_of_threads(void)
+bool enqueue(void *element_data)
 {
-    terminator = thrd_current();
-    while (thread_queue.first != NULL)
-    {
-        thread_queue.first->is_terminated = true;
-        cnd_signal(&thread_queue.first->condition_var);
-        // Move to the next node to avoid an infinite loop.
-        thread_queue.first = thread_queue.first->next_node;
-    }
-    // Reset the thread queue to a clean state after clearing it.
-    thread_queue.last = NULL;
-    thread_queue.count_of_waiting_threads = 0;
+    return queue_enqueue(&default_queue, element_data);
 }
 
-void enqueue(void *element_data)
+void *dequeue(void)
 {
-    mtx_lock(&data_queue.lock);
-    struct DataNode *new_node = initialize_data_node(element_data);
-    insert_node_into_data_queue(new_node);
-    mtx_unlock(&data_queue.lock);
+    return queue_dequeue(&default_queue);
+}
 
-    if (data_queue.size > 0 && thread_queue.count_of_waiting_threads > 0)
-    {
-        // Signaling the first thread in the queue if there are elements in the data queue and waiting threads.
-        cnd_signal(&thread_queue.first->condition_var);
-    }
+bool dequeueUntil(const struct timespec *deadline, void **out)
+{
+    return queue_dequeue_until(&default_queue, deadline, out);
 }
 
-struct DataNode *initialize_data_node(void *data)
+bool enqueuePriority(void *element_data, int prio)
 {
-    // Assuming malloc succeeds as per instructions.
-    struct DataNode *node = (struct DataNode *)malloc(sizeof(struct DataNode));
-    node->data_ptr = data;
-    node->next_node = NULL;
-    node->data_index = data_queue.added_count;
-    return node;
+    return queue_enqueue_priority(&default_queue, element_data, prio);
 }
 
-void insert_node_into_data_queue(struct DataNode *node_to_add)
+bool enqueueNode(struct queue_link *link)
 {
-    data_queue.size == 0 ? insert_node_into_empty_data_queue(node_to_add) : insert_node_into_nonempty_data_queue(node_to_add);
+    return queue_enqueue_node(&default_queue, link);
 }
 
-void insert_node_into_empty_data_queue(struct DataNode *node_to_add)
+struct queue_link *dequeueNode(void)
 {
-    data_queue.first = node_to_add;
-    data_queue.last = node_to_add;
-    data_queue.size++;
-    data_queue.added_count++;
+    return queue_dequeue_node(&default_queue);
 }
 
-void insert_node_into_nonempty_data_queue(struct DataNode *node_to_add)
+bool tryEnqueue(void *element)
 {
-    data_queue.last->next_node = node_to_add;
-    data_queue.last = node_to_add;
-    data_queue.size++;
-    data_queue.added_count++;
+    return queue_try_enqueue(&default_queue, element);
 }
 
-void *dequeue(void)
+void queueStats(struct queue_stats *stats)
 {
-    mtx_lock(&data_queue.lock);
-    // This loop blocks as required
-    while (should_current_thread_yield())
+    queue_get_stats(&default_queue, stats);
+}
+
+bool tryDequeue(void **element)
+{
+    return queue_try_dequeue(&default_queue, element);
+}
+
+bool enqueueMany(void **items, size_t count)
+{
+    return queue_enqueue_many(&default_queue, items, count);
+}
+
+size_t dequeueMany(void **out, size_t max, size_t min)
+{
+    return queue_dequeue_many(&default_queue, out, max, min);
+}
+
+size_t drainQueue(int (*fn)(void **, size_t, void *), void *ctx, size_t max_batch)
+{
+    return queue_drain(&default_queue, fn, ctx, max_batch);
+}
+
+bool enqueueCopy(const void *item, size_t size)
+{
+    return queue_enqueue_copy(&default_queue, item, size);
+}
+
+void *dequeueCopy(void *out)
+{
+    return queue_dequeue_copy(&default_queue, out);
+}
+
+size_t size(void)
+{
+    return queue_size(&default_queue);
+}
+
+size_t waiting(void)
+{
+    return queue_waiting(&default_queue);
+}
+
+size_t visited(void)
+{
+    return queue_visited(&default_queue);
+}
+
+int queueNotifyFd(void)
+{
+    return queue_notify_fd(&default_queue);
+}
+
+void queueNotifyRearm(void)
+{
+    queue_notify_rearm(&default_queue);
+}
+
+bool peek(void **out)
+{
+    return queue_peek(&default_queue, out);
+}
+
+size_t peekN(void **out, size_t max)
+{
+    return queue_peek_many(&default_queue, out, max);
+}
+
+bool dequeueAsync(void (*callback)(void *item, void *ctx), void *ctx)
+{
+    return queue_dequeue_async(&default_queue, callback, ctx);
+}
+
+queue_t *queue_create(const queue_opts *opts)
+{
+    // Assuming malloc succeeds as per instructions. The hot fields are cache-line aligned, which plain malloc does not guarantee.
+    struct queue *q = (struct queue *)aligned_alloc(alignof(struct queue), sizeof(struct queue));
+    queue_init(q, opts);
+    return q;
+}
+
+void queue_destroy(queue_t *q)
+{
+    queue_fini(q);
+    free(q);
+}
+
+void queue_init(struct queue *q, const struct queue_opts *opts)
+{
+    q->shards = NULL;
+    q->shard_count = 0;
+    q->numa_nodes = 0;
+    q->node_consumers = NULL;
+    struct queue_opts outer_opts;
+    if (opts != NULL && opts->shards > 1 && !opts->spsc)
     {
-        enqueue_thread_node();
-        struct ThreadNode *current = thread_queue.last;
-        cnd_wait(&current->condition_var, &data_queue.lock);
-        if (current->is_terminated)
+        initialize_shards(q, opts);
+        // Every node needs a shard of its own, and the statistics only have room for so many.
+        q->numa_nodes = opts->numa_nodes < q->shard_count ? opts->numa_nodes : q->shard_count;
+        if (q->numa_nodes > QUEUE_MAX_NUMA_NODES)
         {
-            struct ThreadNode *previous_first;
-            previous_first = thread_queue.first;
-            thread_queue.first = previous_first->next_node;
-            // Prevents runaway threads upon destruction
-            free(previous_first);
-            thrd_join(terminator, NULL);
+            q->numa_nodes = QUEUE_MAX_NUMA_NODES;
+        }
+        if (q->numa_nodes > 1)
+        {
+            // Assuming malloc succeeds as per instructions.
+            q->node_consumers = (struct NodeConsumers *)aligned_alloc(alignof(struct NodeConsumers), q->numa_nodes * sizeof(struct NodeConsumers));
+            for (size_t node = 0; node < q->numa_nodes; node++)
+            {
+                atomic_init(&q->node_consumers[node].active, 0);
+            }
         }
-        if (data_queue.first && retrieve_first_waiting_status() <= data_queue.first->data_index)
+        // The outer queue holds no items, so it keeps only the options that shape how consumers wait.
+        outer_opts = (struct queue_opts){.spin_ns = opts->spin_ns, .pollable = opts->pollable, .wakeup = opts->wakeup, .inline_size = opts->inline_size};
+        opts = &outer_opts;
+    }
+    q->use_spsc = opts != NULL && opts->spsc;
+    q->use_lock_free = opts != NULL && opts->lock_free && !q->use_spsc;
+    q->barging = opts != NULL && opts->wakeup == QUEUE_BARGING;
+    q->inline_size = opts != NULL ? opts->inline_size : 0;
+    q->closed = false;
+    atomic_init(&q->producers_in_flight, 0);
+    // Initialize data queue pointers to null, indicating an empty queue.
+    q->data_queue.first = NULL;
+    q->data_queue.last = NULL;
+    for (int lane = 0; lane < QUEUE_PRIORITY_LANES - 1; lane++)
+    {
+        q->data_queue.priority_lanes[lane].first = NULL;
+        q->data_queue.priority_lanes[lane].last = NULL;
+    }
+    q->data_queue.lane_mask = 0;
+    // Reset all data queue counters to 0, reflecting an empty state.
+    q->data_queue.size = 0;
+    q->data_queue.processed_count = 0;
+    q->data_queue.added_count = 0;
+    // Initialize the mutex lock for data queue operations.
+    mtx_init(&q->data_queue.lock, mtx_plain);
+    
+    // Initialize thread queue pointers to null, showing no threads are queued.
+    q->thread_queue.first = NULL;
+    q->thread_queue.last = NULL;
+    // Reset the count of waiting threads to 0.
+    q->thread_queue.count_of_waiting_threads = 0;
+
+    q->capacity_limit.capacity = opts != NULL ? opts->capacity : 0;
+    q->capacity_limit.free_slots = q->capacity_limit.capacity;
+    q->capacity_limit.producer_queue.first = NULL;
+    q->capacity_limit.producer_queue.last = NULL;
+    q->capacity_limit.producer_queue.count_of_waiting_threads = 0;
+
+    size_t prealloc = opts != NULL ? opts->prealloc : 0;
+    // A bounded queue never needs more nodes than its capacity, plus the lock-free dummy, so carve them all out now.
+    size_t bounded_nodes = q->capacity_limit.capacity > 0 ? q->capacity_limit.capacity + (q->use_lock_free ? 1 : 0) : 0;
+    if (prealloc < bounded_nodes)
+    {
+        prealloc = bounded_nodes;
+    }
+    // SPSC items sit in ring segments and never take a pool node.
+    if (q->use_spsc)
+    {
+        prealloc = 0;
+    }
+    // Inline payloads follow the wrapper, rounded up so every node in a chunk stays aligned.
+    size_t data_node_size = (sizeof(struct DataNode) + q->inline_size + alignof(struct DataNode) - 1) / alignof(struct DataNode) * alignof(struct DataNode);
+    // A shard of a NUMA-aware queue still carries numa_nodes from the outer options. calloc'ing its nodes here would place them all on the creator's node,
+    // so they wait for a consumer on the shard's node to claim them (see enter_consumer_node), or else for the first producer to run short. An unsharded queue with numa_nodes defers the same way.
+    bool first_touch = opts != NULL && opts->shards <= 1 && opts->numa_nodes > 1;
+    initialize_node_pool(&q->node_pool, q->use_lock_free ? sizeof(struct LockFreeNode) : data_node_size, first_touch ? 0 : prealloc);
+    if (q->use_lock_free)
+    {
+        initialize_lock_free_queue(q);
+    }
+    if (first_touch)
+    {
+        atomic_store_explicit(&q->node_pool.deferred_prealloc, prealloc, memory_order_relaxed);
+    }
+    if (q->use_spsc)
+    {
+        initialize_spsc_queue(q);
+    }
+
+    initialize_notifier(q, opts != NULL && opts->pollable);
+    mtx_init(&q->async_waiters.lock, mtx_plain);
+    q->async_waiters.first = NULL;
+    q->async_waiters.last = NULL;
+    atomic_init(&q->async_waiters.count, 0);
+
+    q->spin_policy.max_spin_ns = opts != NULL ? opts->spin_ns : 0;
+    q->spin_policy.last_arrival_ns = 0;
+    // Until arrivals are observed, consumers spin for the full ceiling.
+    q->spin_policy.mean_interarrival_ns = q->spin_policy.max_spin_ns / SPIN_BUDGET_FACTOR;
+
+    q->stats_stripes = NULL;
+    if (opts != NULL && opts->per_thread_stats)
+    {
+        // Assuming malloc succeeds as per instructions.
+        q->stats_stripes = (struct StatsStripe *)aligned_alloc(alignof(struct StatsStripe), STATS_STRIPES * sizeof(struct StatsStripe));
+        for (int i = 0; i < STATS_STRIPES; i++)
         {
-            dequeue_thread_node();
+            atomic_init(&q->stats_stripes[i].added_count, 0);
+            atomic_init(&q->stats_stripes[i].processed_count, 0);
         }
     }
 
-    struct DataNode *dequeued_node = data_queue.first;
-    data_queue.first = dequeued_node->next_node;
-    if (data_queue.first == NULL)
+#ifdef QUEUE_STATS
+    atomic_init(&q->counters.lock_acquisitions, 0);
+    atomic_init(&q->counters.contended_acquisitions, 0);
+    atomic_init(&q->counters.waits, 0);
+    atomic_init(&q->counters.spurious_wakeups, 0);
+    atomic_init(&q->counters.parked_ns, 0);
+    atomic_init(&q->counters.residency_samples, 0);
+    atomic_init(&q->counters.residency_ns, 0);
+    for (int node = 0; node < QUEUE_MAX_NUMA_NODES; node++)
     {
-        data_queue.last = NULL;
+        atomic_init(&q->counters.numa_local_dequeues[node], 0);
+        atomic_init(&q->counters.numa_remote_dequeues[node], 0);
     }
-    data_queue.size--;
-    data_queue.processed_count++;
-    mtx_unlock(&data_queue.lock);
-    void *data = dequeued_node->data_ptr;
-    free(dequeued_node);
-    return data;
+#endif
 }
 
-
-bool should_current_thread_yield(void)
+void queue_fini(struct queue *q)
 {
-    if (data_queue.size == 0)
+    cancel_async_waiters(q);
+    // Acquire the lock on the data queue to ensure exclusive access.
+    lock_data_queue(q);
+    // Clear all nodes from the data queue safely.
+    clear_all_data_nodes(q);
+    // Dismantle the thread queue, ensuring all thread nodes are properly managed.
+    dismantle_queue_of_threads(q);
+    // Release the lock after operations are completed.
+    mtx_unlock(&q->data_queue.lock);
+    // Destroy the mutex lock, as the data queue will no longer be in use.
+    mtx_destroy(&q->data_queue.lock);
+    // Lock-free items live in the pool as well, so releasing its chunks clears them; only the heap boxes of queued copies need freeing first.
+    if (q->use_lock_free)
     {
-        return true;
+        free_lock_free_boxes(q);
     }
-    if (thread_queue.count_of_waiting_threads <= data_queue.size)
+    destroy_node_pool(&q->node_pool);
+    if (q->use_spsc)
     {
-        return false;
+        destroy_spsc_queue(q);
+    }
+    destroy_notifier(q);
+    free(q->stats_stripes);
+    free(q->node_consumers);
+    for (size_t i = 0; i < q->shard_count; i++)
+    {
+        queue_fini(&q->shards[i]);
     }
-    int first_waiting_on = retrieve_first_waiting_status();
-    return first_waiting_on > data_queue.first->data_index;
+    free(q->shards);
 }
 
-int retrieve_first_waiting_status(void)
+void initialize_shards(struct queue *q, const struct queue_opts *opts)
 {
-    struct ThreadNode *thread_node = thread_queue.first;
-    while (thread_node != NULL)
+    struct queue_opts shard_opts = *opts;
+    shard_opts.shards = 0;
+    // Nobody blocks on a shard, consumers spin and park on the outer queue, which is also the one that notifies.
+    shard_opts.spin_ns = 0;
+    shard_opts.pollable = false;
+    q->shard_count = opts->shards;
+    // Assuming malloc succeeds as per instructions.
+    q->shards = (struct queue *)aligned_alloc(alignof(struct queue), q->shard_count * sizeof(struct queue));
+    for (size_t i = 0; i < q->shard_count; i++)
     {
-        if (thrd_equal(thrd_current(), thread_node->thread_id))
-        {
-            return thread_node->waiting_for;
-        }
-        thread_node = thread_node->next_node;
+        queue_init(&q->shards[i], &shard_opts);
     }
-    return -1;
 }
 
-void enqueue_thread_node(void)
+void clear_all_data_nodes(struct queue *q)
 {
-    struct ThreadNode *new_thread_node = initialize_thread_node();
-    insert_node_into_thread_queue(new_thread_node);
+    // Wrappers go back to the allocator with the pool's chunks right after this, and caller-owned links stay with the caller, so a backlog is dropped without walking it.
+    q->data_queue.first = NULL;
+    for (int lane = 0; lane < QUEUE_PRIORITY_LANES - 1; lane++)
+    {
+        q->data_queue.priority_lanes[lane].first = NULL;
+        q->data_queue.priority_lanes[lane].last = NULL;
+    }
+    q->data_queue.lane_mask = 0;
+    // Although resetting these fields might not be strictly necessary, it ensures the data queue is in a clean state.
+    q->data_queue.last = NULL;
+    q->data_queue.size = 0;
+    q->data_queue.processed_count = 0;
+    q->data_queue.added_count = 0;
+}
+
+void dismantle_queue_of_threads(struct queue *q)
+{
+    q->terminator = thrd_current();
+    terminate_thread_list(&q->thread_queue);
+    // Producers parked on a full queue are released the same way; their items are dropped with the queue.
+    terminate_thread_list(&q->capacity_limit.producer_queue);
 }
 
-void dequeue_thread_node(void)
+void terminate_thread_list(struct QueueOfThreads *threads)
 {
-    struct ThreadNode *dequeued_thread = thread_queue.first;
-    thread_queue.first = dequeued_thread->next_node;
-    free(dequeued_thread);
-    if (thread_queue.first == NULL)
+    while (threads->first != NULL)
     {
-        thread_queue.last = NULL;
+        threads->first->is_terminated = true;
+        cnd_signal(threads->first->condition_var);
+        // Move to the next node to avoid an infinite loop.
+        threads->first = threads->first->next_node;
     }
-    thread_queue.count_of_waiting_threads--;
+    // Reset the thread queue to a clean state after clearing it.
+    threads->last = NULL;
+    threads->count_of_waiting_threads = 0;
 }
 
-void insert_node_into_thread_queue(struct ThreadNode *node_to_add)
+bool queue_enqueue(queue_t *q, void *element_data)
 {
-    thread_queue.count_of_waiting_threads == 0 ? insert_node_into_empty_thread_queue(node_to_add) : insert_node_into_nonempty_thread_queue(node_to_add);
+    if (!enter_enqueue(q))
+    {
+        return false;
+    }
+    // acquire_slots only fails when the queue is closed or destroyed while we wait for room.
+    bool added = q->shards != NULL ? enqueue_into_shard(q, &element_data, 1) : acquire_slots(q, 1) && append_item(q, element_data);
+    leave_enqueue(q);
+    return added;
 }
 
-void insert_node_into_empty_thread_queue(struct ThreadNode *node_to_add)
+// The mutex path rechecks closed under the lock before linking an item in (refuse_closed_enqueue), but the other paths push without it.
+// Their producers are counted from before the check until the push is visible, so a consumer that finds the queue closed, empty and no producer in flight knows nothing can follow.
+bool enter_enqueue(struct queue *q)
 {
-    thread_queue.first = node_to_add;
-    thread_queue.last = node_to_add;
-    thread_queue.count_of_waiting_threads++;
+    bool counted = q->use_lock_free || q->use_spsc || q->shards != NULL;
+    if (counted)
+    {
+        atomic_fetch_add(&q->producers_in_flight, 1);
+    }
+    if (q->closed)
+    {
+        if (counted)
+        {
+            leave_enqueue(q);
+        }
+        return false;
+    }
+    return true;
 }
 
-void insert_node_into_nonempty_thread_queue(struct ThreadNode *node_to_add)
+// The last producer out of a closed queue may leave it drained without pushing anything, so it wakes the waiters that were waiting on it.
+void leave_enqueue(struct queue *q)
 {
-    thread_queue.last->next_node = node_to_add;
-    thread_queue.last = node_to_add;
-    thread_queue.count_of_waiting_threads++;
+    if (!q->use_lock_free && !q->use_spsc && q->shards == NULL)
+    {
+        return;
+    }
+    if (atomic_fetch_sub(&q->producers_in_flight, 1) == 1 && q->closed)
+    {
+        lock_data_queue(q);
+        release_closed_waiters(q);
+        mtx_unlock(&q->data_queue.lock);
+        signal_notifier(q);
+    }
 }
 
-struct ThreadNode *initialize_thread_node(void)
+bool closed_and_drained(struct queue *q)
 {
-    struct ThreadNode *thread_node = (struct ThreadNode *)malloc(sizeof(struct ThreadNode));
-    thread_node->thread_id = thrd_current();
-    thread_node->next_node = NULL;
-    thread_node->is_terminated = false;
-    cnd_init(&thread_node->condition_var);
-    thread_node->waiting_for = data_queue.added_count + thread_queue.count_of_waiting_threads;
-    return thread_node;
+    return q->closed && atomic_load(&q->producers_in_flight) == 0 && !has_pending_items(q);
 }
 
-bool tryDequeue(void **element)
+// Lanes only exist on the mutex path; lock-free and sharded queues, like priorities of 0 or less, enqueue normally.
+bool queue_enqueue_priority(queue_t *q, void *element_data, int prio)
 {
-    mtx_lock(&data_queue.lock);
-    while (data_queue.size == 0 || data_queue.first == NULL)
+    if (prio <= 0 || q->use_lock_free || q->use_spsc || q->shards != NULL)
+    {
+        return queue_enqueue(q, element_data);
+    }
+    if (q->closed || !acquire_slots(q, 1))
+    {
+        return false;
+    }
+    int lane = (prio < QUEUE_PRIORITY_LANES ? prio : QUEUE_PRIORITY_LANES - 1) - 1;
+    lock_data_queue(q);
+    if (refuse_closed_enqueue(q, 1))
     {
-        mtx_unlock(&data_queue.lock);
         return false;
     }
-    struct DataNode *dequeued_node = data_queue.first;
-    data_queue.first = dequeued_node->next_node;
-    if (data_queue.first == NULL)
+    if (!hand_off_to_waiter(q, element_data))
     {
-        data_queue.last = NULL;
+        insert_node_into_priority_lane(q, &initialize_data_node(q, element_data)->entry, lane);
+        // Wake the next waiter in line; whoever dequeues next takes the most urgent item.
+        wake_data_waiters(q, 1);
     }
-    data_queue.size--;
-    data_queue.processed_count++;
-    mtx_unlock(&data_queue.lock);
-    *element = dequeued_node->data_ptr;
-    free(dequeued_node);
+    mtx_unlock(&q->data_queue.lock);
+    record_arrival(q, 1);
+    signal_notifier(q);
     return true;
 }
 
-size_t size(void)
+// Lock-free and sharded queues cannot link caller memory into their lists, so they carry the link as an ordinary item instead.
+bool queue_enqueue_node(queue_t *q, struct queue_link *link)
 {
-    return data_queue.size;
+    if (q->use_lock_free || q->use_spsc || q->shards != NULL)
+    {
+        return queue_enqueue(q, link);
+    }
+    if (q->closed || !acquire_slots(q, 1))
+    {
+        return false;
+    }
+    record_arrival(q, 1);
+    lock_data_queue(q);
+    if (refuse_closed_enqueue(q, 1))
+    {
+        return false;
+    }
+    // A caller-owned link dequeues as itself, so it can be handed over like any other item.
+    if (!hand_off_to_waiter(q, link))
+    {
+        link->next = NULL;
+        link->pooled = false;
+        insert_node_into_data_queue(q, link);
+        wake_data_waiters(q, 1);
+    }
+    mtx_unlock(&q->data_queue.lock);
+    signal_notifier(q);
+    return true;
 }
 
-size_t waiting(void)
+bool queue_enqueue_copy(queue_t *q, const void *item, size_t size)
 {
-    return thread_queue.count_of_waiting_threads;
+    if (size > q->inline_size || !enter_enqueue(q))
+    {
+        return false;
+    }
+    bool added = append_copy(q, item, size);
+    leave_enqueue(q);
+    return added;
 }
 
-size_t visited(void)
+bool append_copy(struct queue *q, const void *item, size_t size)
 {
-    return data_queue.processed_count;
+    if (q->shards != NULL)
+    {
+        if (!queue_enqueue_copy(producer_shard(q), item, size))
+        {
+            return false;
+        }
+        record_arrival(q, 1);
+        wake_first_waiter(q);
+        signal_notifier(q);
+        return true;
+    }
+    if (q->use_spsc)
+    {
+        if (!acquire_slots(q, 1))
+        {
+            return false;
+        }
+        record_arrival(q, 1);
+        spsc_push_copy(q, item, size);
+        wake_first_waiter(q);
+        signal_notifier(q);
+        return true;
+    }
+    if (q->use_lock_free)
+    {
+        if (!acquire_slots(q, 1))
+        {
+            return false;
+        }
+        record_arrival(q, 1);
+        // Lock-free nodes are read speculatively by racing dequeuers, so the copy travels in a heap block; the node marks it as one.
+        // Assuming malloc succeeds as per instructions.
+        void *box = malloc(q->inline_size);
+        memcpy(box, item, size);
+        memset((unsigned char *)box + size, 0, q->inline_size - size);
+        lock_free_push(q, &box, 1, true);
+        wake_first_waiter(q);
+        signal_notifier(q);
+        return true;
+    }
+    if (!acquire_slots(q, 1))
+    {
+        return false;
+    }
+    record_arrival(q, 1);
+    lock_data_queue(q);
+    if (refuse_closed_enqueue(q, 1))
+    {
+        return false;
+    }
+    // There is no pointer to hand a parked consumer, so the payload always goes through the list.
+    struct DataNode *node = initialize_data_node(q, NULL);
+    node->inline_payload = true;
+    memcpy(node->payload, item, size);
+    memset(node->payload + size, 0, q->inline_size - size);
+    insert_node_into_data_queue(q, &node->entry);
+    wake_data_waiters(q, 1);
+    mtx_unlock(&q->data_queue.lock);
+    signal_notifier(q);
+    return true;
+}
+
+// Every path that finds a copy, list node, ring slot or heap box, moves it into out and returns out; anything else comes back as queue_dequeue returned it.
+void *queue_dequeue_copy(queue_t *q, void *out)
+{
+    thread_state.copy_destination = out;
+    void *data = queue_dequeue(q);
+    thread_state.copy_destination = NULL;
+    return data;
+}
+
+// Caller-owned links come out of the data queue as themselves, so this is dequeue with the type restored.
+struct queue_link *queue_dequeue_node(queue_t *q)
+{
+    return (struct queue_link *)queue_dequeue(q);
+}
+
+bool queue_try_enqueue(queue_t *q, void *element_data)
+{
+    if (!enter_enqueue(q))
+    {
+        return false;
+    }
+    bool added;
+    if (q->shards != NULL)
+    {
+        added = queue_try_enqueue(producer_shard(q), element_data);
+        if (added)
+        {
+            record_arrival(q, 1);
+            wake_first_waiter(q);
+            signal_notifier(q);
+        }
+    }
+    else
+    {
+        added = reserve_slots(q, 1) && append_item(q, element_data);
+    }
+    leave_enqueue(q);
+    return added;
+}
+
+bool queue_enqueue_many(queue_t *q, void **items, size_t count)
+{
+    if (!enter_enqueue(q))
+    {
+        return false;
+    }
+    bool added = q->shards != NULL ? enqueue_into_shard(q, items, count) : append_in_pieces(q, items, count);
+    leave_enqueue(q);
+    return added;
+}
+
+bool append_in_pieces(struct queue *q, void **items, size_t count)
+{
+    size_t capacity = q->capacity_limit.capacity;
+    if (capacity == 0)
+    {
+        return append_items(q, items, count);
+    }
+    // A batch larger than the queue can hold goes in capacity-sized pieces as consumers make room.
+    while (count > 0)
+    {
+        size_t piece = count < capacity ? count : capacity;
+        if (!acquire_slots(q, piece) || !append_items(q, items, piece))
+        {
+            return false;
+        }
+        items += piece;
+        count -= piece;
+    }
+    return true;
+}
+
+bool append_item(struct queue *q, void *element_data)
+{
+    record_arrival(q, 1);
+    if (q->use_spsc)
+    {
+        spsc_push(q, &element_data, 1);
+        wake_first_waiter(q);
+        signal_notifier(q);
+        return true;
+    }
+    if (q->use_lock_free)
+    {
+        lock_free_push(q, &element_data, 1, false);
+        wake_first_waiter(q);
+        signal_notifier(q);
+        return true;
+    }
+
+    lock_data_queue(q);
+    if (refuse_closed_enqueue(q, 1))
+    {
+        return false;
+    }
+    if (hand_off_to_waiter(q, element_data))
+    {
+        mtx_unlock(&q->data_queue.lock);
+        return true;
+    }
+    struct DataNode *new_node = initialize_data_node(q, element_data);
+    insert_node_into_data_queue(q, &new_node->entry);
+    // Waiter nodes live on their owners' stacks, so they may only be touched while the lock is held.
+    wake_data_waiters(q, 1);
+    mtx_unlock(&q->data_queue.lock);
+    signal_notifier(q);
+    return true;
+}
+
+bool append_items(struct queue *q, void **items, size_t count)
+{
+    if (count == 0)
+    {
+        return true;
+    }
+    record_arrival(q, count);
+    if (q->use_spsc)
+    {
+        spsc_push(q, items, count);
+        wake_first_waiter(q);
+        signal_notifier(q);
+        return true;
+    }
+    if (q->use_lock_free)
+    {
+        lock_free_push(q, items, count, false);
+        // Lock-free waiters hand the baton on themselves, so waking the first one is enough.
+        wake_first_waiter(q);
+        signal_notifier(q);
+        return true;
+    }
+
+    // Build the chain before taking the lock; its nodes come from this thread's cache.
+    struct DataNode *chain_first = (struct DataNode *)acquire_pool_node(&q->node_pool);
+    struct DataNode *chain_last = chain_first;
+    chain_first->data_ptr = items[0];
+    chain_first->inline_payload = false;
+    chain_first->entry.pooled = true;
+    STAMP_ENQUEUE(chain_first);
+    for (size_t i = 1; i < count; i++)
+    {
+        struct DataNode *node = (struct DataNode *)acquire_pool_node(&q->node_pool);
+        node->data_ptr = items[i];
+        node->inline_payload = false;
+        node->entry.pooled = true;
+        STAMP_ENQUEUE(node);
+        chain_last->entry.next = &node->entry;
+        chain_last = node;
+    }
+    chain_last->entry.next = NULL;
+
+    lock_data_queue(q);
+    if (refuse_closed_enqueue(q, count))
+    {
+        // Nobody has seen the chain, so its nodes simply go back.
+        for (struct queue_link *entry = &chain_first->entry; entry != NULL;)
+        {
+            struct DataNode *node = (struct DataNode *)((char *)entry - offsetof(struct DataNode, entry));
+            entry = entry->next;
+            release_pool_node(&q->node_pool, &node->link);
+        }
+        return false;
+    }
+    splice_chain_into_data_queue(q, &chain_first->entry, &chain_last->entry, count);
+    wake_data_waiters(q, count);
+    mtx_unlock(&q->data_queue.lock);
+    signal_notifier(q);
+    return true;
+}
+
+// Called with data_queue.lock held, just before an item is linked in. Enqueues check closed without the lock first; a close that slipped in since is caught here, where consumers decide the queue is drained, so no item lands behind one that already returned QUEUE_CLOSED.
+// On refusal the lock is dropped and the reserved slots are given back.
+bool refuse_closed_enqueue(struct queue *q, size_t count)
+{
+    if (!q->closed)
+    {
+        return false;
+    }
+    mtx_unlock(&q->data_queue.lock);
+    release_slots(q, count);
+    return true;
+}
+
+void splice_chain_into_data_queue(struct queue *q, struct queue_link *chain_first, struct queue_link *chain_last, size_t count)
+{
+    if (q->data_queue.first == NULL)
+    {
+        q->data_queue.first = chain_first;
+    }
+    else
+    {
+        q->data_queue.last->next = chain_first;
+    }
+    q->data_queue.last = chain_last;
+    advance_locked_counter(&q->data_queue.size, count);
+    advance_locked_counter(&q->data_queue.added_count, count);
+}
+
+// Wakes one parked consumer per new item, in queue order; called with data_queue.lock held.
+// Waiters that already have a wakeup pending are owed an earlier item, so the new ones go to the waiters behind them.
+void wake_data_waiters(struct queue *q, size_t count)
+{
+    if (q->barging && !q->closed)
+    {
+        // Nobody is owed a particular item, so one consumer on its way is enough; it passes the baton on if it leaves items behind.
+        if (q->thread_queue.first != NULL)
+        {
+            signal_thread_node(q->thread_queue.first);
+        }
+        return;
+    }
+    size_t woken = 0;
+    for (struct ThreadNode *waiter = q->thread_queue.first; woken < count && waiter != NULL; waiter = waiter->next_node)
+    {
+        if (!waiter->wake_pending)
+        {
+            signal_thread_node(waiter);
+            woken++;
+        }
+    }
+}
+
+// Gives an item straight to the first parked consumer when nothing is queued ahead of it, skipping the data list on both sides; called with data_queue.lock held.
+bool hand_off_to_waiter(struct queue *q, void *data)
+{
+    struct ThreadNode *waiter = q->thread_queue.first;
+    // A waiter that is already being woken may be owed an item that someone else took meanwhile; leave it to the usual path.
+    // A barging queue leaves the item on the list instead, for whichever consumer gets to it first.
+    if (q->barging || waiter == NULL || waiter->wake_pending || q->data_queue.size > 0)
+    {
+        return false;
+    }
+    // The item takes the next index and is consumed on the spot, so the tickets of everyone behind stay valid.
+    advance_locked_counter(&q->data_queue.added_count, 1);
+    count_processed(q, 1);
+    dequeue_thread_node(&q->thread_queue, waiter);
+    waiter->handoff = data;
+    waiter->has_handoff = true;
+    signal_thread_node(waiter);
+    return true;
+}
+
+// Signals a parked thread unless a wakeup is already on its way; called with data_queue.lock held, which also keeps the stack node alive.
+void signal_thread_node(struct ThreadNode *node)
+{
+    if (node->wake_pending)
+    {
+        return;
+    }
+    node->wake_pending = true;
+    cnd_signal(node->condition_var);
+}
+
+struct DataNode *initialize_data_node(struct queue *q, void *data)
+{
+    struct DataNode *node = (struct DataNode *)acquire_pool_node(&q->node_pool);
+    node->data_ptr = data;
+    node->inline_payload = false;
+    node->entry.next = NULL;
+    node->entry.pooled = true;
+    STAMP_ENQUEUE(node);
+    return node;
+}
+
+void insert_node_into_data_queue(struct queue *q, struct queue_link *node_to_add)
+{
+    q->data_queue.first == NULL ? insert_node_into_empty_data_queue(q, node_to_add) : insert_node_into_nonempty_data_queue(q, node_to_add);
+}
+
+void insert_node_into_empty_data_queue(struct queue *q, struct queue_link *node_to_add)
+{
+    q->data_queue.first = node_to_add;
+    q->data_queue.last = node_to_add;
+    advance_locked_counter(&q->data_queue.size, 1);
+    advance_locked_counter(&q->data_queue.added_count, 1);
+}
+
+void insert_node_into_nonempty_data_queue(struct queue *q, struct queue_link *node_to_add)
+{
+    q->data_queue.last->next = node_to_add;
+    q->data_queue.last = node_to_add;
+    advance_locked_counter(&q->data_queue.size, 1);
+    advance_locked_counter(&q->data_queue.added_count, 1);
+}
+
+// Appends to one of the priority lanes; called with data_queue.lock held.
+void insert_node_into_priority_lane(struct queue *q, struct queue_link *node_to_add, int lane)
+{
+    struct DataLane *target = &q->data_queue.priority_lanes[lane];
+    if (target->first == NULL)
+    {
+        target->first = node_to_add;
+        q->data_queue.lane_mask |= 1u << lane;
+    }
+    else
+    {
+        target->last->next = node_to_add;
+    }
+    target->last = node_to_add;
+    advance_locked_counter(&q->data_queue.size, 1);
+    advance_locked_counter(&q->data_queue.added_count, 1);
+}
+
+// Unlinks the head of the most urgent non-empty lane; the caller adjusts size and must know an item is queued.
+struct queue_link *pop_data_node(struct queue *q)
+{
+    if (q->data_queue.lane_mask == 0)
+    {
+        struct queue_link *node = q->data_queue.first;
+        q->data_queue.first = node->next;
+        if (q->data_queue.first == NULL)
+        {
+            q->data_queue.last = NULL;
+        }
+        return node;
+    }
+    int lane = 31 - __builtin_clz(q->data_queue.lane_mask);
+    struct DataLane *source = &q->data_queue.priority_lanes[lane];
+    struct queue_link *node = source->first;
+    source->first = node->next;
+    if (source->first == NULL)
+    {
+        source->last = NULL;
+        q->data_queue.lane_mask &= ~(1u << lane);
+    }
+    return node;
+}
+
+// A ticket is the number of items that must be taken before its waiter's turn comes, so it is checked against how many have been taken, not against which item is oldest.
+// An urgent item taken out of arrival order still counts as one turn, so the waiter behind goes on to the item left behind instead of parking next to it.
+uint64_t taken_data_count(struct queue *q)
+{
+    return q->data_queue.added_count - q->data_queue.size;
+}
+
+// Orders sequence numbers by their distance rather than their value, so the order survives a wrap-around.
+bool sequence_before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+// Turns a dequeued entry back into what the caller enqueued; wrappers are recycled, caller-owned links are handed back as they are.
+void *unwrap_data_node(struct queue *q, struct queue_link *entry)
+{
+    if (!entry->pooled)
+    {
+        return entry;
+    }
+    struct DataNode *node = (struct DataNode *)((char *)entry - offsetof(struct DataNode, entry));
+    void *data = node->inline_payload ? copy_inline_payload(q, node->payload) : node->data_ptr;
+    RECORD_RESIDENCY(q, node->enqueued_ns);
+    release_pool_node(&q->node_pool, &node->link);
+    return data;
+}
+
+// The node or ring slot is reused right after this, so its payload moves into the caller's queue_dequeue_copy buffer, or a heap copy for every other dequeue.
+void *copy_inline_payload(struct queue *q, const unsigned char *payload)
+{
+    void *copy = thread_state.copy_destination;
+    if (copy == NULL)
+    {
+        // Assuming malloc succeeds as per instructions.
+        copy = malloc(q->inline_size);
+    }
+    // One buffer takes one payload.
+    thread_state.copy_destination = NULL;
+    memcpy(copy, payload, q->inline_size);
+    return copy;
+}
+
+// A box already is a heap copy, so only queue_dequeue_copy pays for moving its payload.
+void *unbox_inline_payload(struct queue *q, void *box)
+{
+    if (thread_state.copy_destination == NULL)
+    {
+        return box;
+    }
+    void *copy = copy_inline_payload(q, box);
+    free(box);
+    return copy;
+}
+
+// Waiters that still have items ahead of them keep waiting; the rest, and every parked producer, leave at once.
+void queue_close(queue_t *q)
+{
+    // Shards close first, waking producers parked on a full one: a consumer that sees the outer queue closed then also sees every item a shard accepted.
+    for (size_t i = 0; i < q->shard_count; i++)
+    {
+        queue_close(&q->shards[i]);
+    }
+    lock_data_queue(q);
+    q->closed = true;
+    release_closed_waiters(q);
+    for (struct ThreadNode *producer = q->capacity_limit.producer_queue.first; producer != NULL; producer = producer->next_node)
+    {
+        signal_thread_node(producer);
+    }
+    mtx_unlock(&q->data_queue.lock);
+    // An event loop learns about the close like about an item: the handle turns readable and tryDequeue hands out QUEUE_CLOSED once drained.
+    signal_notifier(q);
+}
+
+// Nobody will feed the waiters of a closed, drained queue again, so all of them are woken in a single pass; called with data_queue.lock held.
+void release_closed_waiters(struct queue *q)
+{
+    if (closed_and_drained(q))
+    {
+        wake_data_waiters(q, q->thread_queue.count_of_waiting_threads);
+    }
+}
+
+void *queue_dequeue(queue_t *q)
+{
+    void *data = NULL;
+    // Without a deadline this only fails when the queue is closed and drained, which stores QUEUE_CLOSED, or destroyed, which leaves data NULL.
+    queue_dequeue_until(q, NULL, &data);
+    return data;
+}
+
+bool queue_dequeue_until(queue_t *q, const struct timespec *deadline, void **out)
+{
+    bool taken = q->use_lock_free || q->use_spsc || q->shards != NULL ? dequeue_lock_free(q, deadline, out) : dequeue_with_lock(q, deadline, out);
+    if (taken)
+    {
+        release_slots(q, 1);
+    }
+    return taken;
+}
+
+bool dequeue_with_lock(struct queue *q, const struct timespec *deadline, void **out)
+{
+    spin_for_item(q);
+    lock_data_queue(q);
+    // The waiter keeps hold of its own node, so ticket checks never search the thread queue.
+    struct ThreadNode waiter_node;
+    struct ThreadNode *current = NULL;
+    // This loop blocks as required
+    while (should_current_thread_yield(q, current))
+    {
+        if (q->closed && q->data_queue.size == 0)
+        {
+            if (current != NULL)
+            {
+                withdraw_thread_node(q, current);
+            }
+            mtx_unlock(&q->data_queue.lock);
+            *out = QUEUE_CLOSED;
+            return false;
+        }
+        // A waiter woken before its turn keeps its place instead of queuing a second node.
+        if (current == NULL)
+        {
+            current = &waiter_node;
+            enqueue_thread_node(q, current);
+        }
+        int wait_result = wait_on_thread_node(q, current, deadline);
+        if (current->has_handoff)
+        {
+            // Our item came straight from the producer, which also took us out of line, even if the deadline passed meanwhile.
+            mtx_unlock(&q->data_queue.lock);
+            *out = current->handoff;
+            return true;
+        }
+        if (current->is_terminated)
+        {
+            // Already detached by dismantle_queue_of_threads, and the lock is gone with the queue.
+            // Prevents runaway threads upon destruction
+            thrd_join(q->terminator, NULL);
+            return false;
+        }
+        // An item may have become ours just as the deadline passed; only give up if it has not.
+        if (wait_result == thrd_timedout && should_current_thread_yield(q, current))
+        {
+            withdraw_thread_node(q, current);
+            mtx_unlock(&q->data_queue.lock);
+            return false;
+        }
+#ifdef QUEUE_STATS
+        if (wait_result == thrd_success && should_current_thread_yield(q, current))
+        {
+            QUEUE_COUNT(q, spurious_wakeups, 1);
+        }
+#endif
+        if (q->data_queue.size > 0 && !sequence_before(taken_data_count(q), current->waiting_for))
+        {
+            dequeue_thread_node(&q->thread_queue, current);
+            current = NULL;
+        }
+    }
+    // Leaving with an item outside our turn (more items than waiters) must not strand our node.
+    if (current != NULL)
+    {
+        dequeue_thread_node(&q->thread_queue, current);
+    }
+
+    struct queue_link *dequeued_node = pop_data_node(q);
+    retreat_locked_counter(&q->data_queue.size, 1);
+    count_processed(q, 1);
+    // Pass the baton: an enqueue that signalled us while we were already awake must not leave the next waiter asleep next to an item.
+    if (q->thread_queue.first != NULL && q->data_queue.size > 0)
+    {
+        signal_thread_node(q->thread_queue.first);
+    }
+    release_closed_waiters(q);
+    mtx_unlock(&q->data_queue.lock);
+    *out = unwrap_data_node(q, dequeued_node);
+    return true;
+}
+
+
+size_t queue_dequeue_many(queue_t *q, void **out, size_t max, size_t min)
+{
+    size_t count = detach_available_items(q, out, max);
+    while (count < min && count < max)
+    {
+        // Not enough yet: wait in line like dequeue() does, then take whatever arrived along with that item.
+        if (!queue_dequeue_until(q, NULL, &out[count]))
+        {
+            // Closed and drained, or destroyed: what we have is all there is.
+            break;
+        }
+        count++;
+        count += detach_available_items(q, out + count, max - count);
+    }
+    return count;
+}
+
+// Takes up to max items that are already queued, without blocking; the mutex path does it in a single lock hold.
+size_t detach_available_items(struct queue *q, void **out, size_t max)
+{
+    size_t count = 0;
+    if (q->shards != NULL)
+    {
+        size_t home = home_shard(q) - q->shards;
+        // Same order as take_from_shards: our own node before the others.
+        for (int remote = 0; remote <= 1; remote++)
+        {
+            for (size_t i = 0; i < q->shard_count && count < max; i++)
+            {
+                size_t shard = (home + i) % q->shard_count;
+                if (shard_is_local(q, shard, home) == (remote == 1))
+                {
+                    continue;
+                }
+                size_t taken = detach_available_items(&q->shards[shard], out + count, max - count);
+                RECORD_SHARD_DEQUEUE(q, home, remote == 1, taken);
+                count += taken;
+            }
+        }
+        return count;
+    }
+    if (q->use_lock_free || q->use_spsc)
+    {
+        while (count < max && pop_available(q, &out[count]))
+        {
+            count++;
+        }
+        release_slots(q, count);
+        return count;
+    }
+    if (max == 0)
+    {
+        return 0;
+    }
+
+    lock_data_queue(q);
+    if (q->data_queue.size == 0)
+    {
+        mtx_unlock(&q->data_queue.lock);
+        return 0;
+    }
+    struct queue_link *chain_first;
+    struct queue_link *chain_last;
+    count = 1;
+    if (q->data_queue.lane_mask == 0)
+    {
+        // Only the default lane is in use, so the whole run is cut off the list at once.
+        chain_first = q->data_queue.first;
+        chain_last = chain_first;
+        while (count < max && chain_last->next != NULL)
+        {
+            chain_last = chain_last->next;
+            count++;
+        }
+        q->data_queue.first = chain_last->next;
+        if (q->data_queue.first == NULL)
+        {
+            q->data_queue.last = NULL;
+        }
+    }
+    else
+    {
+        // Urgent lanes are drained first, node by node, into a private chain.
+        chain_first = pop_data_node(q);
+        chain_last = chain_first;
+        while (count < max && count < q->data_queue.size)
+        {
+            chain_last->next = pop_data_node(q);
+            chain_last = chain_last->next;
+            count++;
+        }
+    }
+    retreat_locked_counter(&q->data_queue.size, count);
+    count_processed(q, count);
+    release_closed_waiters(q);
+    mtx_unlock(&q->data_queue.lock);
+
+    // The detached chain is private now, so copying out and recycling happen outside the lock.
+    struct queue_link *node = chain_first;
+    for (size_t i = 0; i < count; i++)
+    {
+        struct queue_link *next_node = node->next;
+        out[i] = unwrap_data_node(q, node);
+        node = next_node;
+    }
+    release_slots(q, count);
+    return count;
+}
+
+size_t queue_drain(queue_t *q, int (*fn)(void **, size_t, void *), void *ctx, size_t max_batch)
+{
+    if (max_batch == 0)
+    {
+        max_batch = 1;
+    }
+    // Assuming malloc succeeds as per instructions.
+    void **batch = (void **)malloc(max_batch * sizeof(void *));
+    size_t delivered = 0;
+    bool stopped = false;
+    // Waiting for the first item goes through dequeue, so a drainer keeps its place in line among other consumers.
+    while (!stopped && queue_dequeue_until(q, NULL, &batch[0]))
+    {
+        size_t count = 1;
+        if (q->use_lock_free || q->use_spsc || q->shards != NULL)
+        {
+            // There is no list to cut off here, so each batch is popped just before it is delivered, and what fn does not see stays queued.
+            while (true)
+            {
+                count += detach_available_items(q, batch + count, max_batch - count);
+                if (count == 0)
+                {
+                    break;
+                }
+                delivered += count;
+                stopped = fn(batch, count, ctx) != 0;
+                if (stopped)
+                {
+                    break;
+                }
+                count = 0;
+            }
+            continue;
+        }
+
+        struct DataLane lanes[QUEUE_PRIORITY_LANES];
+        size_t remaining = detach_data_lanes(q, lanes);
+        // dequeue already released the slot of the first item.
+        size_t released = 1;
+        // Most urgent lane first, like dequeue; lanes[0] is the default one.
+        for (int lane = QUEUE_PRIORITY_LANES - 1; lane >= 0 && !stopped; lane--)
+        {
+            while (lanes[lane].first != NULL)
+            {
+                // A full batch goes out before the next item is stored; the first dequeued item may already have filled it.
+                if (count == max_batch)
+                {
+                    delivered += count;
+                    stopped = !deliver_drained_batch(q, fn, ctx, batch, count, released);
+                    count = 0;
+                    released = 0;
+                    if (stopped)
+                    {
+                        break;
+                    }
+                }
+                struct queue_link *node = lanes[lane].first;
+                lanes[lane].first = node->next;
+                remaining--;
+                batch[count++] = unwrap_data_node(q, node);
+            }
+        }
+        if (count > 0)
+        {
+            delivered += count;
+            stopped = !deliver_drained_batch(q, fn, ctx, batch, count, released);
+        }
+        if (remaining > 0)
+        {
+            return_data_lanes(q, lanes, remaining);
+        }
+    }
+    free(batch);
+    return delivered;
+}
+
+// Cuts every lane off the data queue in one short lock hold, whatever the backlog; lanes[0] receives the default lane, lanes[i] priority i. Returns how many items were taken.
+size_t detach_data_lanes(struct queue *q, struct DataLane *lanes)
+{
+    lock_data_queue(q);
+    size_t count = q->data_queue.size;
+    lanes[0].first = q->data_queue.first;
+    lanes[0].last = q->data_queue.last;
+    q->data_queue.first = NULL;
+    q->data_queue.last = NULL;
+    for (int lane = 0; lane < QUEUE_PRIORITY_LANES - 1; lane++)
+    {
+        lanes[lane + 1] = q->data_queue.priority_lanes[lane];
+        q->data_queue.priority_lanes[lane].first = NULL;
+        q->data_queue.priority_lanes[lane].last = NULL;
+    }
+    q->data_queue.lane_mask = 0;
+    retreat_locked_counter(&q->data_queue.size, count);
+    count_processed(q, count);
+    release_closed_waiters(q);
+    mtx_unlock(&q->data_queue.lock);
+    return count;
+}
+
+// Puts back what a stopped drain did not deliver, ahead of anything that arrived meanwhile, so FIFO order per lane is as if it was never taken.
+void return_data_lanes(struct queue *q, struct DataLane *lanes, size_t count)
+{
+    lock_data_queue(q);
+    for (int lane = 0; lane < QUEUE_PRIORITY_LANES; lane++)
+    {
+        if (lanes[lane].first == NULL)
+        {
+            continue;
+        }
+        struct queue_link **first = lane == 0 ? &q->data_queue.first : &q->data_queue.priority_lanes[lane - 1].first;
+        struct queue_link **last = lane == 0 ? &q->data_queue.last : &q->data_queue.priority_lanes[lane - 1].last;
+        lanes[lane].last->next = *first;
+        if (*first == NULL)
+        {
+            *last = lanes[lane].last;
+        }
+        *first = lanes[lane].first;
+        if (lane > 0)
+        {
+            q->data_queue.lane_mask |= 1u << (lane - 1);
+        }
+    }
+    advance_locked_counter(&q->data_queue.size, count);
+    // Nobody took these items after all.
+    if (q->stats_stripes != NULL)
+    {
+        atomic_fetch_sub_explicit(&stats_stripe_for(q)->processed_count, count, memory_order_relaxed);
+    }
+    else
+    {
+        retreat_locked_counter(&q->data_queue.processed_count, count);
+    }
+    wake_data_waiters(q, count);
+    mtx_unlock(&q->data_queue.lock);
+    signal_notifier(q);
+}
+
+// The batch belongs to fn from here on, so the slots of all but its first released items are freed first; returns false once fn asks to stop.
+bool deliver_drained_batch(struct queue *q, int (*fn)(void **, size_t, void *), void *ctx, void **batch, size_t count, size_t released)
+{
+    release_slots(q, count - released);
+    return fn(batch, count, ctx) == 0;
+}
+
+bool should_current_thread_yield(struct queue *q, struct ThreadNode *current)
+{
+    if (q->data_queue.size == 0)
+    {
+        return true;
+    }
+    if (q->barging || q->thread_queue.count_of_waiting_threads <= q->data_queue.size)
+    {
+        return false;
+    }
+    // A thread that is not queued yet has no ticket, so it never yields to the ticket order.
+    return current != NULL && sequence_before(taken_data_count(q), current->waiting_for);
+}
+
+void enqueue_thread_node(struct queue *q, struct ThreadNode *node_to_add)
+{
+    initialize_thread_node(q, node_to_add);
+    insert_node_into_thread_queue(&q->thread_queue, node_to_add);
+}
+
+void dequeue_thread_node(struct QueueOfThreads *threads, struct ThreadNode *node_to_remove)
+{
+    if (node_to_remove->prev_node != NULL)
+    {
+        node_to_remove->prev_node->next_node = node_to_remove->next_node;
+    }
+    else
+    {
+        threads->first = node_to_remove->next_node;
+    }
+    if (node_to_remove->next_node != NULL)
+    {
+        node_to_remove->next_node->prev_node = node_to_remove->prev_node;
+    }
+    else
+    {
+        threads->last = node_to_remove->prev_node;
+    }
+    threads->count_of_waiting_threads--;
+}
+
+void insert_node_into_thread_queue(struct QueueOfThreads *threads, struct ThreadNode *node_to_add)
+{
+    threads->count_of_waiting_threads == 0 ? insert_node_into_empty_thread_queue(threads, node_to_add) : insert_node_into_nonempty_thread_queue(threads, node_to_add);
+}
+
+void insert_node_into_empty_thread_queue(struct QueueOfThreads *threads, struct ThreadNode *node_to_add)
+{
+    node_to_add->prev_node = NULL;
+    threads->first = node_to_add;
+    threads->last = node_to_add;
+    threads->count_of_waiting_threads++;
+}
+
+void insert_node_into_nonempty_thread_queue(struct QueueOfThreads *threads, struct ThreadNode *node_to_add)
+{
+    node_to_add->prev_node = threads->last;
+    threads->last->next_node = node_to_add;
+    threads->last = node_to_add;
+    threads->count_of_waiting_threads++;
+}
+
+void initialize_thread_node(struct queue *q, struct ThreadNode *thread_node)
+{
+    thread_node->condition_var = current_wake_condition();
+    thread_node->thread_id = thrd_current();
+    thread_node->next_node = NULL;
+    thread_node->is_terminated = false;
+    thread_node->wake_pending = false;
+    thread_node->has_handoff = false;
+    thread_node->woken_out_of_turn = false;
+    thread_node->overtaken = 0;
+    thread_node->numa_node = q->numa_nodes > 1 ? current_numa_node() % q->numa_nodes : 0;
+    thread_node->waiting_for = q->data_queue.added_count + q->thread_queue.count_of_waiting_threads;
+}
+
+bool queue_try_dequeue(queue_t *q, void **element)
+{
+    if (!take_available_item(q, element))
+    {
+        if (closed_and_drained(q))
+        {
+            *element = QUEUE_CLOSED;
+        }
+        return false;
+    }
+    release_slots(q, 1);
+    return true;
+}
+
+bool take_available_item(struct queue *q, void **element)
+{
+    if (q->use_lock_free || q->use_spsc || q->shards != NULL)
+    {
+        return pop_available(q, element);
+    }
+
+    lock_data_queue(q);
+    while (q->data_queue.size == 0)
+    {
+        mtx_unlock(&q->data_queue.lock);
+        return false;
+    }
+    struct queue_link *dequeued_node = pop_data_node(q);
+    retreat_locked_counter(&q->data_queue.size, 1);
+    count_processed(q, 1);
+    release_closed_waiters(q);
+    mtx_unlock(&q->data_queue.lock);
+    *element = unwrap_data_node(q, dequeued_node);
+    return true;
+}
+
+bool queue_peek(queue_t *q, void **out)
+{
+    return queue_peek_many(q, out, 1) == 1;
+}
+
+size_t queue_peek_many(queue_t *q, void **out, size_t max)
+{
+    if (max == 0)
+    {
+        return 0;
+    }
+    if (q->shards != NULL)
+    {
+        // Same order as take_from_shards, so the first item is the one this thread would dequeue next.
+        size_t home = home_shard(q) - q->shards;
+        size_t count = 0;
+        for (int remote = 0; remote <= 1; remote++)
+        {
+            for (size_t i = 0; i < q->shard_count && count < max; i++)
+            {
+                size_t shard = (home + i) % q->shard_count;
+                if (shard_is_local(q, shard, home) != (remote == 1))
+                {
+                    count += queue_peek_many(&q->shards[shard], out + count, max - count);
+                }
+            }
+        }
+        return count;
+    }
+    if (q->use_spsc)
+    {
+        return spsc_peek(q, out, max);
+    }
+    if (q->use_lock_free)
+    {
+        return lock_free_peek(q, out, max);
+    }
+    // An empty queue is told apart without the lock; otherwise one short hold reads the heads, which is still far cheaper than a dequeue and re-enqueue.
+    // Walking without it would need every list word atomic, and caller-owned queue_links are not type-stable: a consumer may free one the moment it is dequeued, so no after-the-fact check could make reading it safe.
+    if (q->data_queue.size == 0)
+    {
+        return 0;
+    }
+    lock_data_queue(q);
+    size_t count = peek_data_lanes(q, out, max);
+    mtx_unlock(&q->data_queue.lock);
+    return count;
+}
+
+// Walks the lanes in the order pop_data_node empties them; called with data_queue.lock held.
+size_t peek_data_lanes(struct queue *q, void **out, size_t max)
+{
+    size_t count = 0;
+    for (int lane = QUEUE_PRIORITY_LANES - 1; lane >= 0 && count < max; lane--)
+    {
+        struct queue_link *entry = lane == 0 ? q->data_queue.first : q->data_queue.priority_lanes[lane - 1].first;
+        for (; entry != NULL && count < max; entry = entry->next)
+        {
+            // Caller-owned links dequeue as themselves, like in unwrap_data_node.
+            out[count++] = entry->pooled ? ((struct DataNode *)((char *)entry - offsetof(struct DataNode, entry)))->data_ptr : entry;
+        }
+    }
+    return count;
+}
+
+void initialize_live_pools(void)
+{
+    mtx_init(&live_pools_lock, mtx_plain);
+    // The destructor hands a thread's cached nodes back when it exits, so short-lived threads don't strand them.
+    tss_create(&thread_state_key, release_thread_state);
+}
+
+void initialize_node_pool(struct NodePool *pool, size_t node_size, size_t prealloc)
+{
+    call_once(&live_pools_once, initialize_live_pools);
+    pool->node_size = node_size;
+    pool->free_list = (uint64_t)NODE_POOL_NULL_INDEX;
+    for (unsigned chunk = 0; chunk < NODE_POOL_MAX_CHUNKS; chunk++)
+    {
+        pool->chunks[chunk] = NULL;
+    }
+    pool->chunk_count = 0;
+    mtx_init(&pool->grow_lock, mtx_plain);
+    pool->id = ++last_pool_id;
+    atomic_init(&pool->deferred_prealloc, 0);
+    carve_node_pool(pool, prealloc);
+
+    mtx_lock(&live_pools_lock);
+    pool->next_live = live_pools;
+    live_pools = pool;
+    mtx_unlock(&live_pools_lock);
+}
+
+void destroy_node_pool(struct NodePool *pool)
+{
+    // Unregister first so no exiting thread flushes into chunks that are about to go away.
+    mtx_lock(&live_pools_lock);
+    for (struct NodePool **link = &live_pools; *link != NULL; link = &(*link)->next_live)
+    {
+        if (*link == pool)
+        {
+            *link = pool->next_live;
+            break;
+        }
+    }
+    mtx_unlock(&live_pools_lock);
+
+    for (unsigned chunk = 0; chunk < pool->chunk_count; chunk++)
+    {
+        free(pool->chunks[chunk]);
+        pool->chunks[chunk] = NULL;
+    }
+    pool->chunk_count = 0;
+    mtx_destroy(&pool->grow_lock);
+}
+
+// Tagged words keep the ABA tag in the upper half and the node index in the lower half.
+static inline uint64_t make_tagged(uint32_t index, uint64_t previous)
+{
+    return (((previous >> 32) + 1) << 32) | index;
+}
+
+static inline uint32_t tagged_index(uint64_t tagged)
+{
+    return (uint32_t)tagged;
+}
+
+struct PoolLink *pool_node_at(struct NodePool *pool, uint32_t index)
+{
+    // Offsetting by the first chunk size turns the doubling layout into "position of the highest set bit".
+    uint64_t position = (uint64_t)index + (1u << NODE_POOL_FIRST_CHUNK_SHIFT);
+    unsigned chunk = 63 - __builtin_clzll(position) - NODE_POOL_FIRST_CHUNK_SHIFT;
+    uint64_t offset = position - ((uint64_t)1 << (chunk + NODE_POOL_FIRST_CHUNK_SHIFT));
+    return (struct PoolLink *)(pool->chunks[chunk] + offset * pool->node_size);
+}
+
+bool pop_central_node(struct NodePool *pool, uint32_t *index)
+{
+    uint64_t top = pool->free_list;
+    while (tagged_index(top) != NODE_POOL_NULL_INDEX)
+    {
+        uint32_t next = pool_node_at(pool, tagged_index(top))->free_next;
+        if (atomic_compare_exchange_weak(&pool->free_list, &top, make_tagged(next, top)))
+        {
+            *index = tagged_index(top);
+            return true;
+        }
+    }
+    return false;
+}
+
+void push_central_chain(struct NodePool *pool, uint32_t first, struct PoolLink *last)
+{
+    uint64_t top = pool->free_list;
+    do
+    {
+        atomic_store_explicit(&last->free_next, tagged_index(top), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&pool->free_list, &top, make_tagged(first, top)));
+}
+
+// Callers hold grow_lock, or own the pool exclusively during initialization.
+void add_node_pool_chunk(struct NodePool *pool)
+{
+    unsigned chunk = pool->chunk_count;
+    if (chunk == NODE_POOL_MAX_CHUNKS)
+    {
+        // Every index is in use; there is no way to represent another node.
+        abort();
+    }
+    uint64_t chunk_size = (uint64_t)1 << (chunk + NODE_POOL_FIRST_CHUNK_SHIFT);
+    uint32_t first_index = (uint32_t)(chunk_size - (1u << NODE_POOL_FIRST_CHUNK_SHIFT));
+    // Assuming malloc succeeds as per instructions. Zeroed so tags of fresh lock-free nodes start from a known value.
+    char *nodes = (char *)calloc(chunk_size, pool->node_size);
+    for (uint64_t offset = 0; offset < chunk_size; offset++)
+    {
+        struct PoolLink *node = (struct PoolLink *)(nodes + offset * pool->node_size);
+        node->index = first_index + (uint32_t)offset;
+        node->free_next = first_index + (uint32_t)offset + 1;
+    }
+    pool->chunks[chunk] = nodes;
+    pool->chunk_count++;
+
+    // Splice the whole chunk onto the free list with a single CAS.
+    push_central_chain(pool, first_index, (struct PoolLink *)(nodes + (chunk_size - 1) * pool->node_size));
+}
+
+// Adds chunks until the pool holds at least prealloc nodes.
+void carve_node_pool(struct NodePool *pool, size_t prealloc)
+{
+    // Chunks double in size, so the first k of them hold 2^shift * (2^k - 1) nodes.
+    while ((((uint64_t)1 << pool->chunk_count) - 1) << NODE_POOL_FIRST_CHUNK_SHIFT < prealloc
+           && pool->chunk_count < NODE_POOL_MAX_CHUNKS)
+    {
+        add_node_pool_chunk(pool);
+    }
+}
+
+void grow_node_pool(struct NodePool *pool)
+{
+    mtx_lock(&pool->grow_lock);
+    // Another thread may have grown the pool while we waited for the lock.
+    if (tagged_index(pool->free_list) == NODE_POOL_NULL_INDEX)
+    {
+        carve_node_pool(pool, atomic_load_explicit(&pool->deferred_prealloc, memory_order_relaxed));
+        atomic_store_explicit(&pool->deferred_prealloc, 0, memory_order_relaxed);
+        if (tagged_index(pool->free_list) == NODE_POOL_NULL_INDEX)
+        {
+            add_node_pool_chunk(pool);
+        }
+    }
+    mtx_unlock(&pool->grow_lock);
+}
+
+// Carves a deferred preallocation now, on the calling thread's node; a no-op once it is carved.
+void carve_deferred_nodes(struct NodePool *pool)
+{
+    if (atomic_load_explicit(&pool->deferred_prealloc, memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    mtx_lock(&pool->grow_lock);
+    carve_node_pool(pool, atomic_load_explicit(&pool->deferred_prealloc, memory_order_relaxed));
+    atomic_store_explicit(&pool->deferred_prealloc, 0, memory_order_relaxed);
+    mtx_unlock(&pool->grow_lock);
+}
+
+// Pool ids are handed out in sequence, so up to NODE_CACHE_SLOTS pools created together, such as one queue's shards, never share a slot.
+// A pool that finds its slot holding another pool's nodes gets NULL and goes straight to the central free list, rather than flushing them through the registry lock on every call; only after NODE_CACHE_BATCH such misses in a row does it take the slot over.
+struct NodeCache *node_cache_for(struct NodePool *pool)
+{
+    struct NodeCache *cache = &thread_state.node_caches[pool->id % NODE_CACHE_SLOTS];
+    if (cache->pool_id == pool->id)
+    {
+        cache->misses = 0;
+    }
+    else
+    {
+        if (cache->count > 0 && ++cache->misses < NODE_CACHE_BATCH)
+        {
+            return NULL;
+        }
+        register_thread_state();
+        flush_node_cache(cache);
+        cache->pool_id = pool->id;
+    }
+    return cache;
+}
+
+static inline void push_cached_node(struct NodeCache *cache, struct PoolLink *node)
+{
+    atomic_store_explicit(&node->free_next, cache->head, memory_order_relaxed);
+    if (cache->count == 0)
+    {
+        cache->tail = node->index;
+    }
+    cache->head = node->index;
+    cache->count++;
+}
+
+void refill_node_cache(struct NodePool *pool, struct NodeCache *cache)
+{
+    uint32_t index;
+    while (cache->count < NODE_CACHE_BATCH)
+    {
+        if (pop_central_node(pool, &index))
+        {
+            push_cached_node(cache, pool_node_at(pool, index));
+        }
+        else if (cache->count > 0)
+        {
+            // A partial batch is enough to make progress; growing is for when there is nothing at all.
+            return;
+        }
+        else
+        {
+            grow_node_pool(pool);
+        }
+    }
+}
+
+void flush_node_cache(struct NodeCache *cache)
+{
+    if (cache->count > 0)
+    {
+        mtx_lock(&live_pools_lock);
+        for (struct NodePool *pool = live_pools; pool != NULL; pool = pool->next_live)
+        {
+            if (pool->id == cache->pool_id)
+            {
+                push_central_chain(pool, cache->head, pool_node_at(pool, cache->tail));
+                break;
+            }
+        }
+        // Nodes of a pool that is no longer live went away with its chunks.
+        mtx_unlock(&live_pools_lock);
+    }
+    cache->pool_id = 0;
+    cache->count = 0;
+    cache->misses = 0;
+}
+
+void register_thread_state(void)
+{
+    if (!thread_state.registered)
+    {
+        tss_set(thread_state_key, &thread_state);
+        thread_state.registered = true;
+    }
+}
+
+void release_thread_state(void *state)
+{
+    struct ThreadState *exiting = (struct ThreadState *)state;
+    for (unsigned slot = 0; slot < NODE_CACHE_SLOTS; slot++)
+    {
+        flush_node_cache(&exiting->node_caches[slot]);
+    }
+    if (exiting->wake_condition_ready)
+    {
+        cnd_destroy(&exiting->wake_condition);
+        exiting->wake_condition_ready = false;
+    }
+}
+
+cnd_t *current_wake_condition(void)
+{
+    if (!thread_state.wake_condition_ready)
+    {
+        cnd_init(&thread_state.wake_condition);
+        thread_state.wake_condition_ready = true;
+        register_thread_state();
+    }
+    return &thread_state.wake_condition;
+}
+
+struct PoolLink *acquire_pool_node(struct NodePool *pool)
+{
+    struct NodeCache *cache = node_cache_for(pool);
+    if (cache == NULL)
+    {
+        uint32_t index;
+        while (!pop_central_node(pool, &index))
+        {
+            grow_node_pool(pool);
+        }
+        return pool_node_at(pool, index);
+    }
+    if (cache->count == 0)
+    {
+        refill_node_cache(pool, cache);
+    }
+    struct PoolLink *node = pool_node_at(pool, cache->head);
+    cache->head = atomic_load_explicit(&node->free_next, memory_order_relaxed);
+    cache->count--;
+    return node;
+}
+
+void release_pool_node(struct NodePool *pool, struct PoolLink *node)
+{
+    struct NodeCache *cache = node_cache_for(pool);
+    if (cache == NULL)
+    {
+        push_central_chain(pool, node->index, node);
+        return;
+    }
+    push_cached_node(cache, node);
+    if (cache->count == 2 * NODE_CACHE_BATCH)
+    {
+        // Keep the most recently used half, which is still warm, and give the rest back in one CAS.
+        struct PoolLink *split = node;
+        for (unsigned kept = 1; kept < NODE_CACHE_BATCH; kept++)
+        {
+            split = pool_node_at(pool, atomic_load_explicit(&split->free_next, memory_order_relaxed));
+        }
+        uint32_t first_returned = atomic_load_explicit(&split->free_next, memory_order_relaxed);
+        push_central_chain(pool, first_returned, pool_node_at(pool, cache->tail));
+        cache->tail = split->index;
+        cache->count = NODE_CACHE_BATCH;
+    }
+}
+
+void initialize_lock_free_queue(struct queue *q)
+{
+    // The list always starts from a dummy node, so head and tail are never null.
+    struct LockFreeNode *dummy = (struct LockFreeNode *)acquire_pool_node(&q->node_pool);
+    dummy->next = (uint64_t)NODE_POOL_NULL_INDEX;
+    q->lock_free_queue.head = dummy->link.index;
+    q->lock_free_queue.tail = dummy->link.index;
+}
+
+struct LockFreeNode *lock_free_node_at(struct queue *q, uint32_t index)
+{
+    return (struct LockFreeNode *)pool_node_at(&q->node_pool, index);
+}
+
+// Appends items as one privately built chain, so a batch costs a single successful CAS on the shared list.
+void lock_free_push(struct queue *q, void **items, size_t count, bool boxed)
+{
+    struct LockFreeNode *node = NULL;
+    uint32_t first_index = NODE_POOL_NULL_INDEX;
+    for (size_t i = count; i-- > 0;)
+    {
+        // Building back to front means each node's successor is known when its next word is written.
+        struct LockFreeNode *previous = (struct LockFreeNode *)acquire_pool_node(&q->node_pool);
+        atomic_store_explicit(&previous->data_ptr, items[i], memory_order_relaxed);
+        atomic_store_explicit(&previous->boxed, boxed, memory_order_relaxed);
+        STAMP_ENQUEUE(previous);
+        // Bumping the tag invalidates anybody still holding a snapshot of this node's previous life.
+        previous->next = make_tagged(first_index, previous->next);
+        if (node == NULL)
+        {
+            node = previous;
+        }
+        first_index = previous->link.index;
+    }
+    // The chain's last node becomes the new tail.
+    uint32_t index = node->link.index;
+    // Counting before linking keeps size() an upper bound, so it never underflows when a pop overtakes us.
+    count_lock_free_added(q, count);
+
+    uint64_t tail;
+    while (true)
+    {
+        tail = q->lock_free_queue.tail;
+        struct LockFreeNode *tail_node = lock_free_node_at(q, tagged_index(tail));
+        uint64_t next = tail_node->next;
+        if (tail != q->lock_free_queue.tail)
+        {
+            continue;
+        }
+        if (tagged_index(next) == NODE_POOL_NULL_INDEX)
+        {
+            if (atomic_compare_exchange_weak(&tail_node->next, &next, make_tagged(first_index, next)))
+            {
+                break;
+            }
+        }
+        else
+        {
+            // The tail is lagging behind; help the other producer swing it forward.
+            atomic_compare_exchange_weak(&q->lock_free_queue.tail, &tail, make_tagged(tagged_index(next), tail));
+        }
+    }
+    atomic_compare_exchange_strong(&q->lock_free_queue.tail, &tail, make_tagged(index, tail));
+}
+
+// Used wherever items are added without the data lock: the lock-free list, and the shards of a sharded queue.
+void wake_first_waiter(struct queue *q)
+{
+    // The push and the registration in dequeue_lock_free are both sequentially consistent, so either we see the waiter here or it sees the item before parking.
+    if (q->thread_queue.count_of_waiting_threads > 0)
+    {
+        lock_data_queue(q);
+        struct ThreadNode *waiter = nearest_waiter(q);
+        if (waiter != NULL)
+        {
+            signal_thread_node(waiter);
+        }
+        mtx_unlock(&q->data_queue.lock);
+    }
+}
+
+void initialize_spsc_queue(struct queue *q)
+{
+    struct SpscSegment *segment = allocate_spsc_segment(q);
+    atomic_init(&segment->next, NULL);
+    q->spsc_queue.read_segment = segment;
+    q->spsc_queue.write_segment = segment;
+    atomic_init(&q->spsc_queue.head, 0);
+    atomic_init(&q->spsc_queue.tail, 0);
+    q->spsc_queue.cached_tail = 0;
+    atomic_init(&q->spsc_queue.spare, NULL);
+}
+
+void destroy_spsc_queue(struct queue *q)
+{
+    struct SpscSegment *segment = q->spsc_queue.read_segment;
+    while (segment != NULL)
+    {
+        struct SpscSegment *next = segment->next;
+        free(segment);
+        segment = next;
+    }
+    free(q->spsc_queue.spare);
+}
+
+// Segments of queues that take copies carry a payload area behind the slots.
+struct SpscSegment *allocate_spsc_segment(struct queue *q)
+{
+    // Assuming malloc succeeds as per instructions.
+    return (struct SpscSegment *)malloc(sizeof(struct SpscSegment) + SPSC_SEGMENT_SLOTS * q->inline_size);
+}
+
+unsigned char *spsc_payload(struct queue *q, struct SpscSegment *segment, size_t slot)
+{
+    return segment->payloads + slot * q->inline_size;
+}
+
+// Producer side: returns the slot for position tail, moving on to a fresh segment at each boundary.
+void **claim_spsc_slot(struct queue *q, size_t tail)
+{
+    struct SpscQueue *spsc = &q->spsc_queue;
+    if (tail % SPSC_SEGMENT_SLOTS == 0 && tail > 0)
+    {
+        struct SpscSegment *segment = atomic_exchange_explicit(&spsc->spare, NULL, memory_order_acquire);
+        if (segment == NULL)
+        {
+            segment = allocate_spsc_segment(q);
+        }
+        atomic_store_explicit(&segment->next, NULL, memory_order_relaxed);
+        // Published by the tail store that follows; the consumer follows this link only once it has seen that tail.
+        atomic_store_explicit(&spsc->write_segment->next, segment, memory_order_relaxed);
+        spsc->write_segment = segment;
+    }
+    return &spsc->write_segment->slots[tail % SPSC_SEGMENT_SLOTS];
+}
+
+// Only ever called by the one producer thread.
+void spsc_push(struct queue *q, void **items, size_t count)
+{
+    struct SpscQueue *spsc = &q->spsc_queue;
+    size_t tail = atomic_load_explicit(&spsc->tail, memory_order_relaxed);
+    for (size_t i = 0; i < count; i++, tail++)
+    {
+        *claim_spsc_slot(q, tail) = items[i];
+    }
+    // Sequentially consistent, not just release: wake_first_waiter reads the waiter count next, and the consumer registers before its last look at the tail.
+    atomic_store_explicit(&spsc->tail, tail, memory_order_seq_cst);
+}
+
+// Producer side: the payload goes into the slot's own area of the segment, so a copy costs no allocation.
+void spsc_push_copy(struct queue *q, const void *item, size_t size)
+{
+    struct SpscQueue *spsc = &q->spsc_queue;
+    size_t tail = atomic_load_explicit(&spsc->tail, memory_order_relaxed);
+    void **slot = claim_spsc_slot(q, tail);
+    unsigned char *payload = spsc_payload(q, spsc->write_segment, tail % SPSC_SEGMENT_SLOTS);
+    memcpy(payload, item, size);
+    memset(payload + size, 0, q->inline_size - size);
+    // No caller can hold a pointer into the ring, so pointing the slot at its own payload marks it as a copy.
+    *slot = payload;
+    atomic_store_explicit(&spsc->tail, tail + 1, memory_order_seq_cst);
+}
+
+// Only ever called by the one consumer thread, with or without the lock.
+bool spsc_pop(struct queue *q, void **data)
+{
+    struct SpscQueue *spsc = &q->spsc_queue;
+    size_t head = atomic_load_explicit(&spsc->head, memory_order_relaxed);
+    if (head == spsc->cached_tail)
+    {
+        spsc->cached_tail = atomic_load_explicit(&spsc->tail, memory_order_acquire);
+        if (head == spsc->cached_tail)
+        {
+            return false;
+        }
+    }
+    if (head % SPSC_SEGMENT_SLOTS == 0 && head > 0)
+    {
+        struct SpscSegment *drained = spsc->read_segment;
+        spsc->read_segment = atomic_load_explicit(&drained->next, memory_order_relaxed);
+        // Keep one spare for the producer; any further drained segment goes back to the allocator.
+        struct SpscSegment *expected = NULL;
+        if (!atomic_compare_exchange_strong_explicit(&spsc->spare, &expected, drained, memory_order_release, memory_order_relaxed))
+        {
+            free(drained);
+        }
+    }
+    void *item = spsc->read_segment->slots[head % SPSC_SEGMENT_SLOTS];
+    if (q->inline_size > 0 && item == spsc_payload(q, spsc->read_segment, head % SPSC_SEGMENT_SLOTS))
+    {
+        // Copied out before the head moves on, while the producer still leaves the slot alone.
+        item = copy_inline_payload(q, item);
+    }
+    *data = item;
+    atomic_store_explicit(&spsc->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Read from any thread; the head is loaded first, so the difference never goes negative.
+size_t spsc_size(struct queue *q)
+{
+    size_t head = atomic_load_explicit(&q->spsc_queue.head, memory_order_acquire);
+    return atomic_load_explicit(&q->spsc_queue.tail, memory_order_acquire) - head;
+}
+
+bool lock_free_pop(struct queue *q, void **data)
+{
+    uint64_t head;
+    void *value;
+    bool boxed;
+#ifdef QUEUE_STATS
+    uint64_t enqueued_ns;
+#endif
+    while (true)
+    {
+        head = q->lock_free_queue.head;
+        uint64_t tail = q->lock_free_queue.tail;
+        uint64_t next = lock_free_node_at(q, tagged_index(head))->next;
+        if (head != q->lock_free_queue.head)
+        {
+            continue;
+        }
+        if (tagged_index(head) == tagged_index(tail))
+        {
+            if (tagged_index(next) == NODE_POOL_NULL_INDEX)
+            {
+                return false;
+            }
+            atomic_compare_exchange_weak(&q->lock_free_queue.tail, &tail, make_tagged(tagged_index(next), tail));
+            continue;
+        }
+        if (tagged_index(next) == NODE_POOL_NULL_INDEX)
+        {
+            // Torn snapshot of a recycled head; retry.
+            continue;
+        }
+        // The value must be read before the CAS: afterwards the successor becomes the dummy and another dequeuer may recycle it.
+        value = atomic_load_explicit(&lock_free_node_at(q, tagged_index(next))->data_ptr, memory_order_relaxed);
+        boxed = atomic_load_explicit(&lock_free_node_at(q, tagged_index(next))->boxed, memory_order_relaxed);
+#ifdef QUEUE_STATS
+        enqueued_ns = atomic_load_explicit(&lock_free_node_at(q, tagged_index(next))->enqueued_ns, memory_order_relaxed);
+#endif
+        if (atomic_compare_exchange_weak(&q->lock_free_queue.head, &head, make_tagged(tagged_index(next), head)))
+        {
+            break;
+        }
+    }
+    release_pool_node(&q->node_pool, &lock_free_node_at(q, tagged_index(head))->link);
+    count_lock_free_taken(q, 1);
+    RECORD_RESIDENCY(q, enqueued_ns);
+    *data = boxed ? unbox_inline_payload(q, value) : value;
+    return true;
+}
+
+// Nodes are only recycled once the head moves past them, so if the head is unchanged after the walk, with the same tag, every value read belonged to a node still queued.
+// Consumers that keep moving the head can invalidate every long walk, so each retry walks half as far, and after LOCK_FREE_PEEK_ATTEMPTS the peek gives up and reports nothing.
+size_t lock_free_peek(struct queue *q, void **out, size_t max)
+{
+    for (int attempt = 0; attempt < LOCK_FREE_PEEK_ATTEMPTS; attempt++, max = max > 1 ? max / 2 : 1)
+    {
+        uint64_t head = q->lock_free_queue.head;
+        uint64_t next = lock_free_node_at(q, tagged_index(head))->next;
+        size_t count = 0;
+        while (count < max && tagged_index(next) != NODE_POOL_NULL_INDEX)
+        {
+            struct LockFreeNode *node = lock_free_node_at(q, tagged_index(next));
+            // Boxed copies peek as NULL like copies on the other paths.
+            out[count++] = atomic_load_explicit(&node->boxed, memory_order_relaxed) ? NULL : atomic_load_explicit(&node->data_ptr, memory_order_relaxed);
+            next = node->next;
+        }
+        if (head == q->lock_free_queue.head)
+        {
+            return count;
+        }
+    }
+    return 0;
+}
+
+// Consumer side only: the producer never writes a slot between head and tail, and drained segments are only unlinked by the consumer.
+size_t spsc_peek(struct queue *q, void **out, size_t max)
+{
+    struct SpscQueue *spsc = &q->spsc_queue;
+    size_t head = atomic_load_explicit(&spsc->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&spsc->tail, memory_order_acquire);
+    struct SpscSegment *segment = spsc->read_segment;
+    size_t count = 0;
+    for (size_t position = head; position != tail && count < max; position++)
+    {
+        // Same step as spsc_pop: the read segment still holds the slot before head until a pop crosses the boundary.
+        if (position % SPSC_SEGMENT_SLOTS == 0 && position > 0)
+        {
+            segment = atomic_load_explicit(&segment->next, memory_order_relaxed);
+        }
+        void *item = segment->slots[position % SPSC_SEGMENT_SLOTS];
+        // Copies have no pointer of their own to show.
+        out[count++] = q->inline_size > 0 && item == spsc_payload(q, segment, position % SPSC_SEGMENT_SLOTS) ? NULL : item;
+    }
+    return count;
+}
+
+// Sharded queues take this path too, since their items sit in shards the outer lock does not guard.
+bool dequeue_lock_free(struct queue *q, const struct timespec *deadline, void **out)
+{
+    void *data;
+    size_t consumer_node = enter_consumer_node(q);
+    spin_for_item(q);
+    // Fast path: take an item without the lock, unless parked waiters are ahead of us in line and the queue is fair to them.
+    if ((q->barging || q->thread_queue.count_of_waiting_threads == 0) && pop_available(q, &data))
+    {
+        leave_consumer_node(q, consumer_node);
+        *out = data;
+        return true;
+    }
+
+    lock_data_queue(q);
+    struct ThreadNode waiter_node;
+    struct ThreadNode *current = &waiter_node;
+    enqueue_thread_node(q, current);
+    // Only the first waiter may take an item, which keeps wakeups in arrival order.
+    while (!may_take_item(q, current) || !pop_available(q, &data))
+    {
+        // A wakeup out of turn only entitles us to the item that came with it.
+        current->woken_out_of_turn = false;
+        if (closed_and_drained(q))
+        {
+            withdraw_thread_node(q, current);
+            mtx_unlock(&q->data_queue.lock);
+            leave_consumer_node(q, consumer_node);
+            *out = QUEUE_CLOSED;
+            return false;
+        }
+        int wait_result = wait_on_thread_node(q, current, deadline);
+        if (current->is_terminated)
+        {
+            // Already detached by dismantle_queue_of_threads, and the lock is gone with the queue; so are the consumer counts.
+            thrd_join(q->terminator, NULL);
+            return false;
+        }
+        if (wait_result == thrd_timedout && (!may_take_item(q, current) || !pop_available(q, &data)))
+        {
+            withdraw_thread_node(q, current);
+            mtx_unlock(&q->data_queue.lock);
+            leave_consumer_node(q, consumer_node);
+            return false;
+        }
+#ifdef QUEUE_STATS
+        if (wait_result == thrd_success && (!may_take_item(q, current) || !has_pending_items(q)))
+        {
+            QUEUE_COUNT(q, spurious_wakeups, 1);
+        }
+#endif
+    }
+    dequeue_thread_node(&q->thread_queue, current);
+    // Pass the baton so the next waiter does not sleep through items that arrived meanwhile.
+    if (q->thread_queue.first != NULL && has_pending_items(q))
+    {
+        signal_thread_node(q->thread_queue.first);
+    }
+    release_closed_waiters(q);
+    mtx_unlock(&q->data_queue.lock);
+    leave_consumer_node(q, consumer_node);
+    *out = data;
+    return true;
+}
+
+int wait_on_thread_node(struct queue *q, struct ThreadNode *node, const struct timespec *deadline)
+{
+#ifdef QUEUE_STATS
+    QUEUE_COUNT(q, waits, 1);
+    uint64_t parked_at = current_time_ns();
+#endif
+    int result = deadline == NULL ? cnd_wait(node->condition_var, &q->data_queue.lock) : cnd_timedwait(node->condition_var, &q->data_queue.lock, deadline);
+    // Back under the lock: whatever woke us, the next signal has to reach us again.
+    node->wake_pending = false;
+#ifdef QUEUE_STATS
+    // The queue is gone once a destroyed waiter wakes up.
+    if (!node->is_terminated)
+    {
+        QUEUE_COUNT(q, parked_ns, current_time_ns() - parked_at);
+    }
+#endif
+    return result;
+}
+
+// Takes a timed-out waiter out of line. Everyone behind it moves up one ticket, so the item it was waiting for goes to its successor instead of stalling the line.
+// Unlinking is O(1), but tickets are absolute item indices, so the renumbering walks every waiter behind this one: O(waiters) per timeout, under the lock.
+void withdraw_thread_node(struct queue *q, struct ThreadNode *node)
+{
+    for (struct ThreadNode *later = node->next_node; later != NULL; later = later->next_node)
+    {
+        later->waiting_for--;
+    }
+    bool was_first = q->thread_queue.first == node;
+    dequeue_thread_node(&q->thread_queue, node);
+    // A wakeup that was meant for the departing waiter must not leave with it.
+    if (was_first && q->thread_queue.first != NULL && has_pending_items(q))
+    {
+        signal_thread_node(q->thread_queue.first);
+    }
+    release_closed_waiters(q);
+}
+
+uint64_t current_time_ns(void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Tells the core we are busy-waiting, so a sibling hyperthread gets the pipeline meanwhile.
+void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void record_arrival(struct queue *q, size_t count)
+{
+    struct SpinPolicy *policy = &q->spin_policy;
+    if (policy->max_spin_ns == 0)
+    {
+        return;
+    }
+    uint64_t now = current_time_ns();
+    uint64_t last = atomic_exchange_explicit(&policy->last_arrival_ns, now, memory_order_relaxed);
+    // The first arrival carries no gap, and neither does a clock that stepped backwards.
+    if (last == 0 || now < last)
+    {
+        return;
+    }
+    uint64_t gap = (now - last) / count;
+    // Any gap beyond the ceiling already means "do not spin"; capping it lets the average recover quickly after an idle period.
+    uint64_t gap_cap = policy->max_spin_ns * SPIN_BUDGET_FACTOR;
+    if (gap > gap_cap)
+    {
+        gap = gap_cap;
+    }
+    uint64_t mean = atomic_load_explicit(&policy->mean_interarrival_ns, memory_order_relaxed);
+    mean = mean - mean / 8 + gap / 8;
+    atomic_store_explicit(&policy->mean_interarrival_ns, mean, memory_order_relaxed);
+}
+
+uint64_t spin_budget_ns(struct queue *q)
+{
+    struct SpinPolicy *policy = &q->spin_policy;
+    uint64_t mean = atomic_load_explicit(&policy->mean_interarrival_ns, memory_order_relaxed);
+    // Items arriving slower than the ceiling are not worth spinning for at all.
+    if (mean > policy->max_spin_ns)
+    {
+        return 0;
+    }
+    uint64_t budget = mean * SPIN_BUDGET_FACTOR;
+    return budget < policy->max_spin_ns ? budget : policy->max_spin_ns;
+}
+
+void spin_for_item(struct queue *q)
+{
+    if (q->spin_policy.max_spin_ns == 0 || has_pending_items(q))
+    {
+        return;
+    }
+    uint64_t budget = spin_budget_ns(q);
+    if (budget == 0)
+    {
+        return;
+    }
+    uint64_t deadline = current_time_ns() + budget;
+    unsigned backoff = 1;
+    // Parked waiters are served first, so once there are any, an item showing up would not be ours anyway.
+    while (!has_pending_items(q) && q->thread_queue.count_of_waiting_threads == 0)
+    {
+        for (unsigned i = 0; i < backoff; i++)
+        {
+            cpu_relax();
+        }
+        if (backoff < SPIN_MAX_BACKOFF)
+        {
+            backoff *= 2;
+        }
+        if (current_time_ns() >= deadline)
+        {
+            return;
+        }
+    }
+}
+
+// The lock-free path decides on the list itself, so its size counter is statistics only and may live in stripes.
+bool has_pending_items(struct queue *q)
+{
+    if (q->shards != NULL)
+    {
+        for (size_t i = 0; i < q->shard_count; i++)
+        {
+            if (has_pending_items(&q->shards[i]))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (q->use_spsc)
+    {
+        return spsc_size(q) > 0;
+    }
+    return q->use_lock_free ? lock_free_has_items(q) : q->data_queue.size > 0;
+}
+
+bool pop_available(struct queue *q, void **data)
+{
+    if (q->use_spsc)
+    {
+        return spsc_pop(q, data);
+    }
+    return q->shards != NULL ? take_from_shards(q, data) : lock_free_pop(q, data);
+}
+
+// Round-robin over all shards, or over the shards of the caller's NUMA node on a NUMA-aware queue.
+struct queue *home_shard(struct queue *q)
+{
+    if (q->numa_nodes <= 1)
+    {
+        return &q->shards[thread_ordinal() % q->shard_count];
+    }
+    return shard_on_node(q, current_numa_node() % q->numa_nodes);
+}
+
+struct queue *shard_on_node(struct queue *q, size_t node)
+{
+    size_t local_shards = (q->shard_count - node + q->numa_nodes - 1) / q->numa_nodes;
+    return &q->shards[node + q->numa_nodes * (thread_ordinal() % local_shards)];
+}
+
+// NUMA placement: an item should be allocated, consumed and recycled on the node of the consumer that takes it, so consumers never free remote nodes.
+// A producer therefore fills a shard of its own node while consumers are dequeuing there, and otherwise one of the next node that has some;
+// consumers only steal across nodes once theirs are empty. A producer that finds no consumer anywhere, such as one filling the queue ahead of them, stays on its own node.
+struct queue *producer_shard(struct queue *q)
+{
+    if (q->node_consumers == NULL)
+    {
+        return home_shard(q);
+    }
+    size_t node = current_numa_node() % q->numa_nodes;
+    for (size_t i = 0; i < q->numa_nodes; i++)
+    {
+        size_t candidate = (node + i) % q->numa_nodes;
+        if (atomic_load_explicit(&q->node_consumers[candidate].active, memory_order_relaxed) > 0)
+        {
+            return shard_on_node(q, candidate);
+        }
+    }
+    return shard_on_node(q, node);
+}
+
+// Counts a consumer in on its node for producer_shard, and carves the deferred preallocation of that node's shards so first touch puts their nodes where they are consumed.
+// Pools that outgrow their preallocation still grow on whichever thread runs short, usually a producer.
+size_t enter_consumer_node(struct queue *q)
+{
+    if (q->node_consumers == NULL)
+    {
+        return 0;
+    }
+    size_t node = current_numa_node() % q->numa_nodes;
+    atomic_fetch_add_explicit(&q->node_consumers[node].active, 1, memory_order_relaxed);
+    for (size_t shard = node; shard < q->shard_count; shard += q->numa_nodes)
+    {
+        carve_deferred_nodes(&q->shards[shard].node_pool);
+    }
+    return node;
+}
+
+void leave_consumer_node(struct queue *q, size_t node)
+{
+    if (q->node_consumers == NULL)
+    {
+        return;
+    }
+    atomic_fetch_sub_explicit(&q->node_consumers[node].active, 1, memory_order_relaxed);
+}
+
+// Our own shard first, then the others in order, so idle consumers steal from busy producers; a NUMA-aware queue only steals across nodes once its own node has nothing.
+bool take_from_shards(struct queue *q, void **data)
+{
+    size_t home = home_shard(q) - q->shards;
+    for (int remote = 0; remote <= 1; remote++)
+    {
+        for (size_t i = 0; i < q->shard_count; i++)
+        {
+            size_t shard = (home + i) % q->shard_count;
+            // A closed, empty shard stores QUEUE_CLOSED, which is only the outer queue's to report.
+            void *item;
+            if (shard_is_local(q, shard, home) == (remote == 1) || !queue_try_dequeue(&q->shards[shard], &item))
+            {
+                continue;
+            }
+            *data = item;
+            RECORD_SHARD_DEQUEUE(q, home, remote == 1, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a shard is on the same NUMA node as the shard at index home; all of them are when the queue ignores topology.
+bool shard_is_local(struct queue *q, size_t shard, size_t home)
+{
+    return q->numa_nodes <= 1 || shard % q->numa_nodes == home % q->numa_nodes;
+}
+
+// The node the calling thread runs on right now; 0 where the platform cannot tell.
+unsigned current_numa_node(void)
+{
+#ifdef QUEUE_HAVE_GETCPU
+    unsigned cpu;
+    unsigned node;
+    if (getcpu(&cpu, &node) == 0)
+    {
+        return node;
+    }
+#endif
+    return 0;
+}
+
+// The waiter a producer should wake; called with data_queue.lock held. A NUMA-aware queue prefers one on the producer's node near the front of the line, as long as the first waiter has not been passed over too often.
+struct ThreadNode *nearest_waiter(struct queue *q)
+{
+    struct ThreadNode *first = q->thread_queue.first;
+    if (q->numa_nodes <= 1 || first == NULL || first->overtaken >= NUMA_WAKE_WINDOW)
+    {
+        return first;
+    }
+    unsigned node = current_numa_node() % q->numa_nodes;
+    struct ThreadNode *waiter = first;
+    for (int i = 0; i < NUMA_WAKE_WINDOW && waiter != NULL; i++, waiter = waiter->next_node)
+    {
+        if (waiter->numa_node != node || waiter->wake_pending)
+        {
+            continue;
+        }
+        if (waiter != first)
+        {
+            waiter->woken_out_of_turn = true;
+            first->overtaken++;
+        }
+        return waiter;
+    }
+    return first;
+}
+
+// Lock-free and sharded waiters take items in line, except for one a producer woke out of turn, or any of them on a barging queue; called with data_queue.lock held.
+bool may_take_item(struct queue *q, struct ThreadNode *node)
+{
+    return q->barging || q->thread_queue.first == node || node->woken_out_of_turn;
+}
+
+// Fails like the shard did, once the queue is closed; a batch may have gone in partly by then, so the waiters are woken either way.
+bool enqueue_into_shard(struct queue *q, void **items, size_t count)
+{
+    record_arrival(q, count);
+    struct queue *shard = producer_shard(q);
+    bool added = count == 1 ? queue_enqueue(shard, items[0]) : queue_enqueue_many(shard, items, count);
+    wake_first_waiter(q);
+    signal_notifier(q);
+    return added;
+}
+
+// Nobody pops any more, so the list from the dummy head on is stable.
+void free_lock_free_boxes(struct queue *q)
+{
+    uint32_t index = tagged_index(lock_free_node_at(q, tagged_index(q->lock_free_queue.head))->next);
+    while (index != NODE_POOL_NULL_INDEX)
+    {
+        struct LockFreeNode *node = lock_free_node_at(q, index);
+        if (node->boxed)
+        {
+            free(node->data_ptr);
+        }
+        index = tagged_index(node->next);
+    }
+}
+
+bool lock_free_has_items(struct queue *q)
+{
+    while (true)
+    {
+        uint64_t head = q->lock_free_queue.head;
+        uint64_t next = lock_free_node_at(q, tagged_index(head))->next;
+        // A head that moved meanwhile may have been recycled, and then its next word describes its new life.
+        if (head == q->lock_free_queue.head)
+        {
+            return tagged_index(next) != NODE_POOL_NULL_INDEX;
+        }
+    }
+}
+
+// Drawn round-robin on first use, so threads spread evenly over statistics stripes and shards.
+unsigned thread_ordinal(void)
+{
+    if (thread_state.ordinal == 0)
+    {
+        thread_state.ordinal = atomic_fetch_add_explicit(&last_thread_ordinal, 1, memory_order_relaxed) + 1;
+    }
+    return thread_state.ordinal - 1;
+}
+
+struct StatsStripe *stats_stripe_for(struct queue *q)
+{
+    return &q->stats_stripes[thread_ordinal() % STATS_STRIPES];
+}
+
+void count_processed(struct queue *q, size_t count)
+{
+    if (q->stats_stripes != NULL)
+    {
+        atomic_fetch_add_explicit(&stats_stripe_for(q)->processed_count, count, memory_order_relaxed);
+        return;
+    }
+    if (q->use_lock_free)
+    {
+        q->data_queue.processed_count += count;
+        return;
+    }
+    advance_locked_counter(&q->data_queue.processed_count, count);
+}
+
+// The lock-free path keeps no size of its own; queue_size derives it from these two totals.
+void count_lock_free_added(struct queue *q, size_t count)
+{
+    if (q->stats_stripes != NULL)
+    {
+        atomic_fetch_add_explicit(&stats_stripe_for(q)->added_count, count, memory_order_relaxed);
+        return;
+    }
+    q->data_queue.added_count += count;
+}
+
+void count_lock_free_taken(struct queue *q, size_t count)
+{
+    count_processed(q, count);
+}
+
+// Counters only lock holders write need no locked read-modify-write: a plain load and store is enough, and lock-free readers see at worst a slightly older value.
+void advance_locked_counter(atomic_ullong *counter, unsigned long long count)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + count, memory_order_relaxed);
+}
+
+void retreat_locked_counter(atomic_ullong *counter, unsigned long long count)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) - count, memory_order_relaxed);
+}
+
+bool reserve_slots(struct queue *q, size_t count)
+{
+    if (q->capacity_limit.capacity == 0)
+    {
+        return true;
+    }
+    unsigned long free_slots = q->capacity_limit.free_slots;
+    while (free_slots >= count)
+    {
+        if (atomic_compare_exchange_weak(&q->capacity_limit.free_slots, &free_slots, free_slots - count))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool acquire_slots(struct queue *q, size_t count)
+{
+    struct CapacityLimit *limit = &q->capacity_limit;
+    // Fast path, unless producers parked earlier are ahead of us in line.
+    if (limit->producer_queue.count_of_waiting_threads == 0 && reserve_slots(q, count))
+    {
+        return true;
+    }
+
+    lock_data_queue(q);
+    struct ThreadNode producer_node;
+    initialize_thread_node(q, &producer_node);
+    insert_node_into_thread_queue(&limit->producer_queue, &producer_node);
+    // Registering before the reserve attempt pairs with release_slots: either we see its slots or it sees us waiting.
+    while (limit->producer_queue.first != &producer_node || !reserve_slots(q, count))
+    {
+        if (q->closed)
+        {
+            // queue_close woke every parked producer, so there is no baton to pass.
+            dequeue_thread_node(&limit->producer_queue, &producer_node);
+            mtx_unlock(&q->data_queue.lock);
+            return false;
+        }
+        wait_on_thread_node(q, &producer_node, NULL);
+        if (producer_node.is_terminated)
+        {
+            // Already detached by dismantle_queue_of_threads, and the lock is gone with the queue.
+            thrd_join(q->terminator, NULL);
+            return false;
+        }
+    }
+    dequeue_thread_node(&limit->producer_queue, &producer_node);
+    // Pass the baton so the next producer does not sleep through slots freed meanwhile.
+    if (limit->producer_queue.first != NULL && limit->free_slots > 0)
+    {
+        signal_thread_node(limit->producer_queue.first);
+    }
+    mtx_unlock(&q->data_queue.lock);
+    return true;
+}
+
+// Called by consumers once they no longer hold the lock, since waking a parked producer takes it.
+void release_slots(struct queue *q, size_t count)
+{
+    struct CapacityLimit *limit = &q->capacity_limit;
+    if (limit->capacity == 0 || count == 0)
+    {
+        return;
+    }
+    limit->free_slots += count;
+    if (limit->producer_queue.count_of_waiting_threads > 0)
+    {
+        lock_data_queue(q);
+        if (limit->producer_queue.first != NULL)
+        {
+            signal_thread_node(limit->producer_queue.first);
+        }
+        mtx_unlock(&q->data_queue.lock);
+    }
+}
+
+void lock_data_queue(struct queue *q)
+{
+#ifdef QUEUE_STATS
+    QUEUE_COUNT(q, lock_acquisitions, 1);
+    if (mtx_trylock(&q->data_queue.lock) == thrd_success)
+    {
+        return;
+    }
+    QUEUE_COUNT(q, contended_acquisitions, 1);
+#endif
+    mtx_lock(&q->data_queue.lock);
+}
+
+#ifdef QUEUE_STATS
+void record_residency(struct queue *q, uint64_t enqueued_ns)
+{
+    QUEUE_COUNT(q, residency_samples, 1);
+    QUEUE_COUNT(q, residency_ns, current_time_ns() - enqueued_ns);
+}
+
+// Counts items taken from the shards of a NUMA-aware queue against the consumer's node, which is the node of its home shard.
+void record_shard_dequeue(struct queue *q, size_t home, bool remote, size_t count)
+{
+    if (q->numa_nodes <= 1 || count == 0)
+    {
+        return;
+    }
+    size_t node = home % q->numa_nodes;
+    if (remote)
+    {
+        QUEUE_COUNT(q, numa_remote_dequeues[node], count);
+    }
+    else
+    {
+        QUEUE_COUNT(q, numa_local_dequeues[node], count);
+    }
+}
+#endif
+
+void queue_get_stats(queue_t *q, struct queue_stats *stats)
+{
+    *stats = (struct queue_stats){
+        .size = queue_size(q),
+        .waiting = queue_waiting(q),
+        .visited = queue_visited(q),
+    };
+#ifdef QUEUE_STATS
+    stats->lock_acquisitions = q->counters.lock_acquisitions;
+    stats->contended_acquisitions = q->counters.contended_acquisitions;
+    stats->waits = q->counters.waits;
+    stats->spurious_wakeups = q->counters.spurious_wakeups;
+    unsigned long long residency_samples = q->counters.residency_samples;
+    stats->avg_parked_ns = stats->waits > 0 ? q->counters.parked_ns / stats->waits : 0;
+    stats->avg_residency_ns = residency_samples > 0 ? q->counters.residency_ns / residency_samples : 0;
+    for (int node = 0; node < QUEUE_MAX_NUMA_NODES; node++)
+    {
+        stats->numa_local_dequeues[node] = q->counters.numa_local_dequeues[node];
+        stats->numa_remote_dequeues[node] = q->counters.numa_remote_dequeues[node];
+    }
+#endif
+}
+
+size_t queue_size(queue_t *q)
+{
+    if (q->shards != NULL)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < q->shard_count; i++)
+        {
+            total += queue_size(&q->shards[i]);
+        }
+        return total;
+    }
+    if (q->use_spsc)
+    {
+        return spsc_size(q);
+    }
+    // The mutex path keeps an exact size under the lock, since waiter tickets depend on it.
+    if (!q->use_lock_free)
+    {
+        return q->data_queue.size;
+    }
+    if (q->stats_stripes == NULL)
+    {
+        // Taken before added, and a pop may be counted before its push, so clamp instead of wrapping.
+        unsigned long long processed = q->data_queue.processed_count;
+        unsigned long long added = q->data_queue.added_count;
+        return added > processed ? added - processed : 0;
+    }
+    // Stripes are read one at a time, so under concurrent updates this is a snapshot that may see a pop before its push.
+    unsigned long processed = 0;
+    unsigned long added = 0;
+    for (int i = 0; i < STATS_STRIPES; i++)
+    {
+        processed += atomic_load_explicit(&q->stats_stripes[i].processed_count, memory_order_relaxed);
+        added += atomic_load_explicit(&q->stats_stripes[i].added_count, memory_order_relaxed);
+    }
+    return added > processed ? added - processed : 0;
+}
+
+size_t queue_waiting(queue_t *q)
+{
+    return q->thread_queue.count_of_waiting_threads;
+}
+
+size_t queue_visited(queue_t *q)
+{
+    if (q->shards != NULL)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < q->shard_count; i++)
+        {
+            total += queue_visited(&q->shards[i]);
+        }
+        return total;
+    }
+    if (q->use_spsc)
+    {
+        return atomic_load_explicit(&q->spsc_queue.head, memory_order_relaxed);
+    }
+    if (q->stats_stripes == NULL)
+    {
+        return q->data_queue.processed_count;
+    }
+    unsigned long processed = 0;
+    for (int i = 0; i < STATS_STRIPES; i++)
+    {
+        processed += atomic_load_explicit(&q->stats_stripes[i].processed_count, memory_order_relaxed);
+    }
+    return processed;
+}
+
+void initialize_notifier(struct queue *q, bool pollable)
+{
+    q->notifier.read_fd = -1;
+    q->notifier.write_fd = -1;
+    atomic_init(&q->notifier.signalled, false);
+    if (!pollable)
+    {
+        return;
+    }
+    // Non-blocking, so neither a rearm on an idle handle nor a producer facing a full pipe ever waits; either failure leaves the handle at -1.
+#if defined(__linux__)
+    q->notifier.read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    q->notifier.write_fd = q->notifier.read_fd;
+#elif defined(__unix__) || defined(__APPLE__)
+    int fds[2];
+    if (pipe(fds) == 0)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        q->notifier.read_fd = fds[0];
+        q->notifier.write_fd = fds[1];
+    }
+#endif
+}
+
+void destroy_notifier(struct queue *q)
+{
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    if (q->notifier.read_fd >= 0)
+    {
+        close(q->notifier.read_fd);
+    }
+    if (q->notifier.write_fd >= 0 && q->notifier.write_fd != q->notifier.read_fd)
+    {
+        close(q->notifier.write_fd);
+    }
+#endif
+}
+
+// Called after an item became visible to consumers, or the queue closed: pending dequeueAsync calls are completed first. Only the first producer since the last rearm makes the system call, so a burst costs one wakeup of the event loop.
+void signal_notifier(struct queue *q)
+{
+    complete_async_waiters(q);
+    if (q->notifier.write_fd < 0 || q->notifier.signalled || atomic_exchange(&q->notifier.signalled, true))
+    {
+        return;
+    }
+#if defined(__linux__)
+    uint64_t one = 1;
+    ssize_t written = write(q->notifier.write_fd, &one, sizeof(one));
+#elif defined(__unix__) || defined(__APPLE__)
+    char byte = 0;
+    ssize_t written = write(q->notifier.write_fd, &byte, 1);
+#endif
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    // Only a full pipe can fail here, and that one is readable already.
+    (void)written;
+#endif
+}
+
+int queue_notify_fd(queue_t *q)
+{
+    return q->notifier.read_fd;
+}
+
+// Drains the handle before clearing the flag: a producer that still saw it set has its item visible to the drain that follows, and any later one writes again.
+void queue_notify_rearm(queue_t *q)
+{
+    if (q->notifier.read_fd < 0)
+    {
+        return;
+    }
+#if defined(__linux__)
+    uint64_t count;
+    ssize_t drained = read(q->notifier.read_fd, &count, sizeof(count));
+    (void)drained;
+#elif defined(__unix__) || defined(__APPLE__)
+    char bytes[64];
+    while (read(q->notifier.read_fd, bytes, sizeof(bytes)) > 0)
+    {
+    }
+#endif
+    atomic_store(&q->notifier.signalled, false);
+}
+
+bool queue_dequeue_async(queue_t *q, void (*callback)(void *item, void *ctx), void *ctx)
+{
+    // The producer completing the call would be a second consumer of the ring.
+    if (q->use_spsc)
+    {
+        return false;
+    }
+    // Assuming malloc succeeds as per instructions.
+    struct AsyncWaiter *waiter = (struct AsyncWaiter *)malloc(sizeof(struct AsyncWaiter));
+    waiter->next = NULL;
+    waiter->callback = callback;
+    waiter->ctx = ctx;
+    mtx_lock(&q->async_waiters.lock);
+    if (q->async_waiters.last == NULL)
+    {
+        q->async_waiters.first = waiter;
+    }
+    else
+    {
+        q->async_waiters.last->next = waiter;
+    }
+    q->async_waiters.last = waiter;
+    atomic_fetch_add(&q->async_waiters.count, 1);
+    mtx_unlock(&q->async_waiters.lock);
+    // Items already queued, or a close that already happened, have no producer coming to complete the call, so try straight away.
+    complete_async_waiters(q);
+    return true;
+}
+
+// Runs each callback on this thread, outside every lock, for as long as there are both waiters and items.
+void complete_async_waiters(struct queue *q)
+{
+    // A callback calling dequeueAsync again lands here; its waiter is left to the loop below, so a long backlog does not grow the stack.
+    if (atomic_load(&q->async_waiters.count) == 0 || thread_state.completing_queue == q)
+    {
+        return;
+    }
+    struct queue *outer = thread_state.completing_queue;
+    thread_state.completing_queue = q;
+    while (atomic_load(&q->async_waiters.count) > 0)
+    {
+        mtx_lock(&q->async_waiters.lock);
+        struct AsyncWaiter *waiter = q->async_waiters.first;
+        void *item = NULL;
+        // Taking the item under the waiter lock keeps completions in registration order.
+        if (waiter == NULL || (!queue_try_dequeue(q, &item) && item != QUEUE_CLOSED))
+        {
+            mtx_unlock(&q->async_waiters.lock);
+            break;
+        }
+        q->async_waiters.first = waiter->next;
+        if (waiter->next == NULL)
+        {
+            q->async_waiters.last = NULL;
+        }
+        atomic_fetch_sub(&q->async_waiters.count, 1);
+        mtx_unlock(&q->async_waiters.lock);
+        waiter->callback(item, waiter->ctx);
+        free(waiter);
+    }
+    thread_state.completing_queue = outer;
+}
+
+// Calls still pending when the queue is destroyed complete with NULL, which is what a blocked dequeue returns then.
+void cancel_async_waiters(struct queue *q)
+{
+    struct AsyncWaiter *waiter = q->async_waiters.first;
+    while (waiter != NULL)
+    {
+        struct AsyncWaiter *next = waiter->next;
+        waiter->callback(NULL, waiter->ctx);
+        free(waiter);
+        waiter = next;
+    }
+    q->async_waiters.first = NULL;
+    q->async_waiters.last = NULL;
+    atomic_store(&q->async_waiters.count, 0);
+    mtx_destroy(&q->async_waiters.lock);
+}
+
+#ifdef QUEUE_HAVE_SHM
+queue_shm_t *queue_shm_open(const char *name, size_t capacity, size_t slot_size)
+{
+    if (capacity == 0 || slot_size == 0)
+    {
+        return NULL;
+    }
+    // Slots keep the alignment malloc would give the payload, and start on a cache line of their own.
+    size_t slot_stride = (slot_size + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+    size_t slots_offset = (sizeof(struct ShmQueueHeader) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    size_t mapped_size = slots_offset + capacity * slot_stride;
+
+    struct ShmQueueHeader *header = NULL;
+    // Exactly one process gets to create and initialize the segment; the rest attach to it.
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        if (ftruncate(fd, (off_t)mapped_size) == 0)
+        {
+            void *mapping = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                header = (struct ShmQueueHeader *)mapping;
+                initialize_shm_header(header, capacity, slot_size, slot_stride, slots_offset);
+            }
+        }
+        if (header == NULL)
+        {
+            shm_unlink(name);
+        }
+    }
+    else if (errno == EEXIST && (fd = shm_open(name, O_RDWR, 0600)) >= 0)
+    {
+        size_t existing_size;
+        header = attach_shm_header(fd, &existing_size);
+        if (header != NULL && (header->capacity != capacity || header->slot_size != slot_size || existing_size != mapped_size))
+        {
+            munmap(header, existing_size);
+            header = NULL;
+        }
+    }
+    if (fd >= 0)
+    {
+        // The mapping keeps the object alive by itself.
+        close(fd);
+    }
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    // Assuming malloc succeeds as per instructions.
+    queue_shm_t *q = (queue_shm_t *)malloc(sizeof(queue_shm_t));
+    q->header = header;
+    q->mapped_size = mapped_size;
+    return q;
+}
+
+void initialize_shm_header(struct ShmQueueHeader *header, size_t capacity, size_t slot_size, size_t slot_stride, size_t slots_offset)
+{
+    header->capacity = capacity;
+    header->slot_size = slot_size;
+    header->slot_stride = slot_stride;
+    header->slots_offset = slots_offset;
+    header->head = 0;
+    header->tail = 0;
+    header->closed = false;
+
+    pthread_mutexattr_t lock_attr;
+    pthread_mutexattr_init(&lock_attr);
+    pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+#ifdef QUEUE_HAVE_ROBUST_MUTEX
+    pthread_mutexattr_setrobust(&lock_attr, SHM_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&header->lock, &lock_attr);
+    pthread_mutexattr_destroy(&lock_attr);
+    // The default clock is CLOCK_REALTIME, which is what TIME_UTC deadlines count in.
+    pthread_condattr_t condition_attr;
+    pthread_condattr_init(&condition_attr);
+    pthread_condattr_setpshared(&condition_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&header->not_empty, &condition_attr);
+    pthread_cond_init(&header->not_full, &condition_attr);
+    pthread_condattr_destroy(&condition_attr);
+
+    atomic_store_explicit(&header->magic, SHM_QUEUE_MAGIC, memory_order_release);
+}
+
+// Maps a segment another process created, once it is sized and initialized; NULL if it cannot be mapped or its creator has not finished within SHM_ATTACH_TIMEOUT_NS.
+struct ShmQueueHeader *attach_shm_header(int fd, size_t *mapped_size)
+{
+    struct stat info;
+    // The creator sizes the object right after creating it, so this only waits for a moment, unless it died first.
+    uint64_t deadline_ns = current_time_ns() + SHM_ATTACH_TIMEOUT_NS;
+    while (true)
+    {
+        if (fstat(fd, &info) != 0)
+        {
+            return NULL;
+        }
+        if (info.st_size > 0)
+        {
+            break;
+        }
+        if (current_time_ns() >= deadline_ns)
+        {
+            return NULL;
+        }
+        thrd_yield();
+    }
+    if (info.st_size < (off_t)sizeof(struct ShmQueueHeader))
+    {
+        return NULL;
+    }
+    *mapped_size = (size_t)info.st_size;
+    void *mapping = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    struct ShmQueueHeader *header = (struct ShmQueueHeader *)mapping;
+    // A creator that died between sizing and initializing the object never sets the magic either.
+    while (atomic_load_explicit(&header->magic, memory_order_acquire) != SHM_QUEUE_MAGIC)
+    {
+        if (current_time_ns() >= deadline_ns)
+        {
+            munmap(mapping, *mapped_size);
+            return NULL;
+        }
+        thrd_yield();
+    }
+    return header;
+}
+
+void queue_shm_detach(queue_shm_t *q)
+{
+    munmap(q->header, q->mapped_size);
+    free(q);
+}
+
+bool queue_shm_unlink(const char *name)
+{
+    return shm_unlink(name) == 0;
+}
+
+void queue_shm_close(queue_shm_t *q)
+{
+    struct ShmQueueHeader *header = q->header;
+    lock_shm_header(header);
+    header->closed = true;
+    pthread_cond_broadcast(&header->not_empty);
+    pthread_cond_broadcast(&header->not_full);
+    pthread_mutex_unlock(&header->lock);
+}
+
+bool queue_shm_enqueue(queue_shm_t *q, const void *item)
+{
+    return put_shm_item(q->header, item, true);
+}
+
+bool queue_shm_try_enqueue(queue_shm_t *q, const void *item)
+{
+    return put_shm_item(q->header, item, false);
+}
+
+bool queue_shm_dequeue(queue_shm_t *q, void *out)
+{
+    return take_shm_item(q->header, NULL, out, true);
+}
+
+bool queue_shm_dequeue_until(queue_shm_t *q, const struct timespec *deadline, void *out)
+{
+    return take_shm_item(q->header, deadline, out, true);
+}
+
+bool queue_shm_try_dequeue(queue_shm_t *q, void *out)
+{
+    return take_shm_item(q->header, NULL, out, false);
+}
+
+size_t queue_shm_size(queue_shm_t *q)
+{
+    lock_shm_header(q->header);
+    size_t count = q->header->tail - q->header->head;
+    pthread_mutex_unlock(&q->header->lock);
+    return count;
+}
+
+char *shm_slot(struct ShmQueueHeader *header, size_t index)
+{
+    return (char *)header + header->slots_offset + index * header->slot_stride;
+}
+
+bool put_shm_item(struct ShmQueueHeader *header, const void *item, bool block)
+{
+    lock_shm_header(header);
+    while (block && header->tail - header->head == header->capacity && !header->closed)
+    {
+        recover_shm_lock(header, pthread_cond_wait(&header->not_full, &header->lock));
+    }
+    if (header->closed || header->tail - header->head == header->capacity)
+    {
+        pthread_mutex_unlock(&header->lock);
+        return false;
+    }
+    // The slot only counts as stored once tail moves past it.
+    memcpy(shm_slot(header, header->tail % header->capacity), item, header->slot_size);
+    header->tail++;
+    pthread_cond_signal(&header->not_empty);
+    pthread_mutex_unlock(&header->lock);
+    return true;
+}
+
+bool take_shm_item(struct ShmQueueHeader *header, const struct timespec *deadline, void *out, bool block)
+{
+    lock_shm_header(header);
+    while (block && header->tail == header->head && !header->closed)
+    {
+        int result = deadline == NULL ? pthread_cond_wait(&header->not_empty, &header->lock) : pthread_cond_timedwait(&header->not_empty, &header->lock, deadline);
+        if (recover_shm_lock(header, result) != 0 && header->tail == header->head)
+        {
+            break;
+        }
+    }
+    if (header->tail == header->head)
+    {
+        pthread_mutex_unlock(&header->lock);
+        return false;
+    }
+    memcpy(out, shm_slot(header, header->head % header->capacity), header->slot_size);
+    header->head++;
+    pthread_cond_signal(&header->not_full);
+    pthread_mutex_unlock(&header->lock);
+    return true;
+}
+
+void lock_shm_header(struct ShmQueueHeader *header)
+{
+    recover_shm_lock(header, pthread_mutex_lock(&header->lock));
+}
+
+// Lock and condition waits report EOWNERDEAD, holding the lock, when its last owner died inside a critical section.
+// head, tail and closed are each published with a single store, so whatever it left is consistent: mark the lock usable again and wake everyone, in case the dead process was about to signal.
+int recover_shm_lock(struct ShmQueueHeader *header, int result)
+{
+#ifdef QUEUE_HAVE_ROBUST_MUTEX
+    if (result == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&header->lock);
+        pthread_cond_broadcast(&header->not_empty);
+        pthread_cond_broadcast(&header->not_full);
+        return 0;
+    }
+#else
+    (void)header;
+#endif
+    return result;
 }
+#endif
@@ -1,11 +1,184 @@
+#ifndef QUEUE_H
+#define QUEUE_H
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
+
+// Priorities accepted by enqueuePriority run from 0 (the normal lane) to QUEUE_PRIORITY_LANES - 1; higher ones are clamped.
+#define QUEUE_PRIORITY_LANES 4
+// Most NUMA nodes queue_opts.numa_nodes and the per-node statistics distinguish.
+#define QUEUE_MAX_NUMA_NODES 8
+
+// How a queue hands items to consumers; selected with queue_opts.wakeup.
+enum queue_wakeup_policy
+{
+    // Items go to parked consumers in arrival order, straight into their hands when nothing is queued, even when a running consumer could have taken the item without a context switch.
+    QUEUE_STRICT_FIFO,
+    // Whoever finds an item takes it, parked or not. A parked consumer is only woken when none is on its way yet, and it wakes the next one if it leaves items behind.
+    QUEUE_BARGING,
+};
+
+// Configuration for queue_create and initQueueWithOpts; passing NULL (or a zeroed struct) selects the defaults used by initQueue.
+struct queue_opts
+{
+    // Store items in a lock-free Michael-Scott list; blocking dequeue only takes the lock to park when the queue is empty.
+    bool lock_free;
+    // Nodes to carve out of the pool up front, so the first enqueues never reach the allocator.
+    size_t prealloc;
+    // Longest time, in nanoseconds, a blocking dequeue polls for an item before parking; the actual spin adapts to recent inter-arrival times. 0 parks immediately.
+    uint64_t spin_ns;
+    // Count visited() (and size() on the lock-free path) per thread and add the counts up on read, so producers and consumers stop sharing counter lines.
+    bool per_thread_stats;
+    // Most items the queue holds before enqueue blocks and tryEnqueue fails; 0 leaves it unbounded. Nodes for the full capacity are preallocated.
+    size_t capacity;
+    // Split the queue into this many independently locked shards, typically one per core. Producers append to their thread's shard and consumers steal from the others when theirs is empty, so FIFO order only holds per shard. 0 or 1 keeps a single queue; capacity and prealloc apply to each shard.
+    size_t shards;
+    // With shards, spread them over this many NUMA nodes and keep each item on its consumer's node; 0 or 1 ignores topology.
+    size_t numa_nodes;
+    // Exactly one producer thread and one consumer thread will ever use the queue: items go through a segmented ring with acquire/release handoff instead of the lock. Takes precedence over lock_free and shards; priorities and intrusive links are queued as plain items.
+    bool spsc;
+    // Give the queue a file descriptor that poll/epoll report readable once items arrive; see queue_notify_fd.
+    bool pollable;
+    // QUEUE_STRICT_FIFO by default; QUEUE_BARGING trades fairness between consumers for fewer context switches.
+    enum queue_wakeup_policy wakeup;
+    // Bytes each node reserves for payloads queued by value with queue_enqueue_copy; 0 disables copies. The mutex path, sharded or not, stores them inside its list nodes and SPSC queues in their ring segments; lock-free queues box them in a heap block.
+    size_t inline_size;
+};
+
+// Snapshot filled in by queueStats. Everything past visited is only counted when queue.c is built with -DQUEUE_STATS, and reads as zero otherwise.
+struct queue_stats
+{
+    size_t size;
+    size_t waiting;
+    size_t visited;
+    uint64_t lock_acquisitions;
+    // Acquisitions that found the lock already held.
+    uint64_t contended_acquisitions;
+    // Times a blocked thread parked on its condition variable.
+    uint64_t waits;
+    // Wakeups after which the dequeuer still had to wait.
+    uint64_t spurious_wakeups;
+    uint64_t avg_parked_ns;
+    // Average time between an item's enqueue and its dequeue.
+    uint64_t avg_residency_ns;
+    // Items a NUMA-aware sharded queue handed to consumers on each node, from a shard on that node or stolen from another; local / (local + remote) is the node's hit rate.
+    uint64_t numa_local_dequeues[QUEUE_MAX_NUMA_NODES];
+    uint64_t numa_remote_dequeues[QUEUE_MAX_NUMA_NODES];
+};
+
+// Embedded in a caller's struct to queue it without a wrapper node, like list_head; offsetof recovers the struct after dequeueNode.
+// The fields belong to the queue while the link is queued. A queue fed with links should be drained with dequeueNode; plain dequeue returns the link pointer.
+struct queue_link
+{
+    struct queue_link *next;
+    bool pooled;
+};
+
+// What dequeue and dequeueNode return, and what tryDequeue and dequeueUntil store, once a closed queue has been drained.
+extern struct queue_link queue_closed_link;
+#define QUEUE_CLOSED ((void*)&queue_closed_link)
+
+// Handle-based API: every queue_t has its own lock, waiters and node pool, so independent stages never contend.
+typedef struct queue queue_t;
+typedef struct queue_opts queue_opts;
+queue_t *queue_create(const queue_opts*);
+void queue_destroy(queue_t*);
+// Stops the queue taking items: every enqueue fails from now on, including producers parked on a full queue, while consumers drain what is left and then get QUEUE_CLOSED.
+// An enqueue racing the close is either refused or drained: consumers only report QUEUE_CLOSED once no producer is left between its closed check and its push.
+void queue_close(queue_t*);
+// The enqueue calls return false once the queue is closed (enqueueMany: before every item went in).
+bool queue_enqueue(queue_t*, void*);
+// Returns false instead of blocking when a bounded queue is full.
+bool queue_try_enqueue(queue_t*, void*);
+// Dequeues take the highest non-empty priority first, FIFO within a priority. Lock-free and sharded queues ignore the priority.
+bool queue_enqueue_priority(queue_t*, void*, int);
+// Links caller-owned memory straight into the queue, with no allocation; blocks like queue_enqueue when a bounded queue is full.
+bool queue_enqueue_node(queue_t*, struct queue_link*);
+struct queue_link* queue_dequeue_node(queue_t*);
+void* queue_dequeue(queue_t*);
+bool queue_try_dequeue(queue_t*, void**);
+// Blocks like queue_dequeue until the absolute TIME_UTC deadline; returns false with *out untouched if it passes first.
+bool queue_dequeue_until(queue_t*, const struct timespec*, void**);
+// Appends n items under a single lock hold and wakes up to n waiters; a bounded queue takes larger batches in capacity-sized pieces.
+bool queue_enqueue_many(queue_t*, void**, size_t);
+// Stores up to max items into out, blocking until at least min were taken; returns how many.
+size_t queue_dequeue_many(queue_t*, void**, size_t, size_t);
+// Consumer loop for bulk processing: blocks like queue_dequeue while the queue is empty, then hands fn everything queued in batches of up to max_batch, called outside the lock.
+// The mutex path detaches the whole backlog in one lock hold. fn returns non-zero to stop, which puts back the detached items it has not seen; the loop also ends once the queue is closed and drained. Returns how many items fn was shown.
+size_t queue_drain(queue_t*, int (*)(void**, size_t, void*), void*, size_t);
+// By-value items for queues built with inline_size: enqueue copies size bytes, zero-padded to inline_size, and fails when they do not fit; dequeue blocks like queue_dequeue, copies inline_size bytes into out and returns out.
+// A pointer queued by queue_enqueue on the same queue passes through: dequeue returns it and leaves out untouched, as it does QUEUE_CLOSED and NULL, so callers compare the result with out.
+// Any other dequeue call hands each copy out as a malloc'd copy the caller frees.
+bool queue_enqueue_copy(queue_t*, const void*, size_t);
+void *queue_dequeue_copy(queue_t*, void*);
+// Stores the item the caller would dequeue next without taking it; false when the queue is empty. Lock-free and SPSC queues read it without any lock; the mutex path skips the lock only when the queue is empty, and otherwise reads in one short hold of the data lock.
+bool queue_peek(queue_t*, void**);
+// Stores up to max of the next items in dequeue order and returns how many; a sharded queue lists its shards in the order the caller steals from them.
+// Both are snapshots: with other consumers running, the items may be gone by the time the caller acts, so a peeked pointer is only dereferenced when the caller knows nobody frees it meanwhile. On an SPSC queue only the consumer may peek; copies from queue_enqueue_copy peek as NULL.
+// A lock-free queue whose consumers keep moving the head may come back short, or empty after a bounded number of attempts, rather than chase it indefinitely.
+size_t queue_peek_many(queue_t*, void**, size_t);
+size_t queue_size(queue_t*);
+size_t queue_waiting(queue_t*);
+size_t queue_visited(queue_t*);
+void queue_get_stats(queue_t*, struct queue_stats*);
+// Readable descriptor of a pollable queue, or -1. It becomes readable when an item arrives after the last rearm, and stays so however many more follow.
+// An event loop that sees it readable calls queue_notify_rearm, then drains with queue_try_dequeue until it fails. The queue owns the descriptor.
+int queue_notify_fd(queue_t*);
+void queue_notify_rearm(queue_t*);
+// Completion-based dequeue for event loops and coroutines: instead of blocking the calling thread, registers cb to be called with the next item, QUEUE_CLOSED once the queue is closed and drained, or NULL if it is destroyed.
+// cb runs on whichever thread makes the item available, usually inside a producer's enqueue, or before this returns if one is queued already; it may call queue_dequeue_async again. Waiters are completed in registration order, taking items like queue_try_dequeue rather than queuing behind blocked dequeues. Returns false, without calling cb, on an SPSC queue.
+bool queue_dequeue_async(queue_t*, void (*)(void*, void*), void*);
+
+#if defined(__unix__) || defined(__APPLE__)
+#define QUEUE_HAVE_SHM
+// Cross-process variant: a bounded FIFO of fixed-size slots inside a POSIX shared-memory object, guarded by a process-shared mutex and condition variables.
+// On Linux the mutex is robust: when a process dies holding it, the next one to lock it picks up the queue as the dead one left it, minus any item it was halfway through storing.
+// The segment holds no pointers, so every process may map it at its own address; items are copied straight into and out of their slot, with no system call unless someone has to block.
+typedef struct queue_shm queue_shm_t;
+// Creates the object name with capacity slots of slot_size bytes, or attaches to an existing one with the same geometry; NULL if that fails, including when the existing object's creator has not finished setting it up within a second.
+queue_shm_t *queue_shm_open(const char *name, size_t capacity, size_t slot_size);
+// Unmaps the queue from this process; it lives on for the others.
+void queue_shm_detach(queue_shm_t*);
+// Removes the name; processes still attached keep their mapping.
+bool queue_shm_unlink(const char *name);
+// Like queue_close, for every attached process.
+void queue_shm_close(queue_shm_t*);
+// Copies slot_size bytes from the item into the queue, blocking while it is full; false once the queue is closed.
+bool queue_shm_enqueue(queue_shm_t*, const void*);
+bool queue_shm_try_enqueue(queue_shm_t*, const void*);
+// Copies the oldest item out, blocking while the queue is empty; false once it is closed and drained, or when the TIME_UTC deadline passes first.
+bool queue_shm_dequeue(queue_shm_t*, void*);
+bool queue_shm_dequeue_until(queue_shm_t*, const struct timespec*, void*);
+bool queue_shm_try_dequeue(queue_shm_t*, void*);
+size_t queue_shm_size(queue_shm_t*);
+#endif
+
+// The original API operates on a single process-wide default queue.
 void initQueue(void);
+void initQueueWithOpts(const struct queue_opts*);
 void destroyQueue(void);
-void enqueue(void*);
+void closeQueue(void);
+bool enqueue(void*);
+bool tryEnqueue(void*);
+bool enqueuePriority(void*, int);
+bool enqueueNode(struct queue_link*);
+struct queue_link* dequeueNode(void);
 void* dequeue(void);
 bool tryDequeue(void**);
+bool dequeueUntil(const struct timespec*, void**);
+bool enqueueMany(void**, size_t);
+size_t dequeueMany(void**, size_t, size_t);
+size_t drainQueue(int (*)(void**, size_t, void*), void*, size_t);
+bool enqueueCopy(const void*, size_t);
+void *dequeueCopy(void*);
 size_t size(void);
 size_t waiting(void);
-size_t visited(void);
\ No newline at end of file
+size_t visited(void);
+void queueStats(struct queue_stats*);
+int queueNotifyFd(void);
+void queueNotifyRearm(void);
+bool dequeueAsync(void (*)(void*, void*), void*);
+bool peek(void**);
+size_t peekN(void**, size_t);
+#endif
@@ -0,0 +1,55 @@
+#ifndef QUEUE_AWAIT_HPP
+#define QUEUE_AWAIT_HPP
+#include <coroutine>
+
+extern "C"
+{
+#include "queue.h"
+}
+
+// co_await queue_next(q) inside a C++20 coroutine suspends the coroutine, not its thread, until an item arrives and evaluates to it: QUEUE_CLOSED once the queue is closed and drained, NULL if it is destroyed.
+// The coroutine resumes on the thread that completed queue_dequeue_async, usually a producer inside its enqueue; a runtime that wants it back on its own executor posts the handle from there.
+// SPSC queues refuse asynchronous waiters; on one of them, co_await resumes at once with NULL unless an item was already queued.
+class queue_awaitable
+{
+public:
+    explicit queue_awaitable(queue_t *q) noexcept : q_(q) {}
+
+    // An item that is already queued is taken without suspending at all.
+    bool await_ready() noexcept
+    {
+        return queue_try_dequeue(q_, &item_) || item_ == QUEUE_CLOSED;
+    }
+
+    // false when the queue refused the waiter: the coroutine carries straight on and item_ is still NULL.
+    // On success complete may already have resumed, and even finished, the coroutine, so this must not be touched afterwards.
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        handle_ = handle;
+        return queue_dequeue_async(q_, &queue_awaitable::complete, this);
+    }
+
+    void *await_resume() const noexcept
+    {
+        return item_;
+    }
+
+private:
+    static void complete(void *item, void *self)
+    {
+        queue_awaitable *awaitable = static_cast<queue_awaitable *>(self);
+        awaitable->item_ = item;
+        awaitable->handle_.resume();
+    }
+
+    queue_t *q_;
+    void *item_ = nullptr;
+    std::coroutine_handle<> handle_;
+};
+
+inline queue_awaitable queue_next(queue_t *q) noexcept
+{
+    return queue_awaitable(q);
+}
+
+#endif
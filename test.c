@@ -3,13 +3,50 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <poll.h>
 #include "queue.c"
+#ifdef QUEUE_HAVE_SHM
+#include <signal.h>
+#include <sys/wait.h>
+#endif
 
 #define NUM_OPERATIONS 10
 #define MAX_SIZE 1000
 #define NUM_THREADS_CONC 100
 #define NUM_THREADS 50
 #define SECOND_IN_NANOSECONDS 1000000000
+#define NUM_SHARDS 4
+
+// Tags each item with where it came from, so per-producer order can be checked.
+struct ShardedItem
+{
+    int producer;
+    int sequence;
+};
+
+// A payload that carries its own queue link, so it is queued without a wrapper node.
+struct LinkedItem
+{
+    int value;
+    struct queue_link link;
+};
+
+// What a drainQueue callback saw, and when it asks the drain to stop.
+struct DrainLog
+{
+    int *seen[4 * SPSC_SEGMENT_SLOTS];
+    size_t count;
+    size_t stop_after;
+    size_t largest_batch;
+};
+
+// Shared by every logical consumer of the dequeueAsync test, whose callbacks may run on any thread.
+struct AsyncLog
+{
+    atomic_int seen[NUM_SHARDS][MAX_SIZE];
+    atomic_int closed;
+    atomic_int destroyed;
+};
 
 int dequeue_with_sleep(void *arg);
 int enqueueItems(void *arg);
@@ -17,6 +54,24 @@ int enqueue_thread(void *arg);
 int dequeue_thread(void *arg);
 int consumer_thread(void *arg);
 int producer_thread(void *arg);
+int forward_stage(void *arg);
+int batch_consumer_thread(void *arg);
+int spin_consumer_thread(void *arg);
+int timed_dequeue_thread(void *arg);
+int bounded_producer_thread(void *arg);
+int sharded_producer_thread(void *arg);
+int node_consumer_thread(void *arg);
+int closing_consumer_thread(void *arg);
+int filling_producer_thread(void *arg);
+int racing_producer_thread(void *arg);
+int racing_consumer_thread(void *arg);
+int spsc_producer_thread(void *arg);
+int record_drained_batch(void **items, size_t count, void *ctx);
+int drain_thread(void *arg);
+int barging_consumer_thread(void *arg);
+int copy_consumer_thread(void *arg);
+void async_consumer_callback(void *item, void *ctx);
+int peeking_consumer_thread(void *arg);
 
 void test_destroyQueue()
 {
@@ -531,6 +586,2077 @@ void test_mixed_operations()
     printf("mixed operations test passed.\n");
 }
 
+void test_lock_free_enqueue_dequeue()
+{
+    printf("=== Testing lock-free enqueue and dequeue ===\n");
+
+    initQueueWithOpts(&(struct queue_opts){.lock_free = true});
+
+    int items[] = {1, 2, 3, 4, 5};
+    size_t num_items = sizeof(items) / sizeof(items[0]);
+
+    void *item;
+    assert(!tryDequeue(&item));
+
+    for (size_t i = 0; i < num_items; i++)
+    {
+        enqueue(&items[i]);
+    }
+    assert(size() == num_items);
+
+    // Alternate blocking and non-blocking dequeues; both must preserve FIFO order
+    for (size_t i = 0; i < num_items; i++)
+    {
+        if (i % 2 == 0)
+        {
+            item = dequeue();
+        }
+        else
+        {
+            assert(tryDequeue(&item));
+        }
+        printf("Dequeued: %d\n", *(int *)item);
+        assert(*(int *)item == items[i]);
+    }
+
+    assert(size() == 0);
+    assert(visited() == num_items);
+    assert(!tryDequeue(&item));
+
+    destroyQueue();
+
+    printf("lock-free enqueue and dequeue test passed.\n");
+}
+
+void test_lock_free_fifo_order()
+{
+    printf("=== Testing lock-free FIFO wakeup order ===\n");
+
+    initQueueWithOpts(&(struct queue_opts){.lock_free = true});
+
+    thrd_t consumer_threads[NUM_OPERATIONS];
+    int dequeue_order[NUM_OPERATIONS];
+
+    // Park the consumers one after another so their arrival order is known
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        dequeue_order[i] = -1;
+        thrd_create(&consumer_threads[i], consumer_thread, &dequeue_order[i]);
+        thrd_sleep(
+            &(const struct timespec){.tv_nsec = 0.05 * SECOND_IN_NANOSECONDS},
+            NULL);
+    }
+    assert(waiting() == NUM_OPERATIONS);
+
+    // Enqueue everything at once; the waiters must still be served in arrival order
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        int *item = malloc(sizeof(int));
+        *item = i + 1;
+        enqueue(item);
+    }
+
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_join(consumer_threads[i], NULL);
+    }
+
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        printf("Thread %d dequeued item %d\n", i, dequeue_order[i]);
+        assert(dequeue_order[i] == i + 1);
+    }
+    assert(waiting() == 0);
+
+    destroyQueue();
+
+    printf("lock-free FIFO wakeup order test passed.\n");
+}
+
+void test_node_pool_reuse()
+{
+    printf("=== Testing node pool reuse ===\n");
+
+    initQueueWithOpts(&(struct queue_opts){.prealloc = MAX_SIZE});
+    unsigned preallocated_chunks = default_queue.node_pool.chunk_count;
+    assert(preallocated_chunks > 0);
+
+    int items[MAX_SIZE];
+    for (int round = 0; round < NUM_OPERATIONS; round++)
+    {
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            items[i] = round * MAX_SIZE + i;
+            enqueue(&items[i]);
+        }
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            int *item = (int *)dequeue();
+            assert(*item == round * MAX_SIZE + i);
+        }
+    }
+
+    // Every burst fits in the preallocated nodes, so the pool must never have grown
+    assert(default_queue.node_pool.chunk_count == preallocated_chunks);
+    assert(visited() == NUM_OPERATIONS * MAX_SIZE);
+
+    destroyQueue();
+
+    // Pools whose ids share a thread cache slot go through the central free list instead of evicting each other on every call
+    queue_t *first = queue_create(NULL);
+    queue_t *fillers[NODE_CACHE_SLOTS - 1];
+    for (int i = 0; i < NODE_CACHE_SLOTS - 1; i++)
+    {
+        fillers[i] = queue_create(NULL);
+    }
+    queue_t *second = queue_create(NULL);
+    assert(second->node_pool.id % NODE_CACHE_SLOTS == first->node_pool.id % NODE_CACHE_SLOTS);
+    struct NodeCache *slot = &thread_state.node_caches[first->node_pool.id % NODE_CACHE_SLOTS];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        queue_enqueue(first, &items[i]);
+        assert(queue_dequeue(first) == &items[i]);
+        queue_enqueue(second, &items[i]);
+        assert(queue_dequeue(second) == &items[i]);
+        assert(slot->pool_id == first->node_pool.id);
+    }
+    // Once the first pool goes quiet, the second takes the slot over
+    for (int i = 0; i < NODE_CACHE_BATCH; i++)
+    {
+        queue_enqueue(second, &items[i]);
+        assert(queue_dequeue(second) == &items[i]);
+    }
+    assert(slot->pool_id == second->node_pool.id);
+    queue_destroy(first);
+    queue_destroy(second);
+    for (int i = 0; i < NODE_CACHE_SLOTS - 1; i++)
+    {
+        queue_destroy(fillers[i]);
+    }
+
+    // More shards than cache slots still hand every item back
+    queue_t *sharded = queue_create(&(queue_opts){.shards = 2 * NODE_CACHE_SLOTS + 1});
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        queue_enqueue(sharded, &items[i]);
+    }
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        assert(queue_dequeue(sharded) != NULL);
+    }
+    assert(queue_size(sharded) == 0);
+    queue_destroy(sharded);
+
+    printf("node pool reuse test passed.\n");
+}
+
+// Moves NUM_OPERATIONS items from the first queue of a pipeline to the second, doubling them on the way
+int forward_stage(void *arg)
+{
+    queue_t **stages = (queue_t **)arg;
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        int *item = (int *)queue_dequeue(stages[0]);
+        *item *= 2;
+        queue_enqueue(stages[1], item);
+    }
+    return 0;
+}
+
+void test_multiple_queues()
+{
+    printf("=== Testing multiple independent queues ===\n");
+
+    queue_t *stages[2] = {queue_create(NULL), queue_create(&(queue_opts){.lock_free = true})};
+
+    // The default queue is a separate instance and must stay untouched
+    initQueue();
+
+    thrd_t stage_thread;
+    thrd_create(&stage_thread, forward_stage, stages);
+
+    int items[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        items[i] = i + 1;
+        queue_enqueue(stages[0], &items[i]);
+    }
+
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        int *item = (int *)queue_dequeue(stages[1]);
+        printf("Dequeued from second stage: %d\n", *item);
+        assert(*item == 2 * (i + 1));
+    }
+    thrd_join(stage_thread, NULL);
+
+    assert(queue_size(stages[0]) == 0 && queue_size(stages[1]) == 0);
+    assert(queue_visited(stages[0]) == NUM_OPERATIONS);
+    assert(queue_visited(stages[1]) == NUM_OPERATIONS);
+    assert(queue_waiting(stages[0]) == 0 && queue_waiting(stages[1]) == 0);
+    assert(size() == 0 && visited() == 0);
+
+    queue_destroy(stages[0]);
+    queue_destroy(stages[1]);
+    destroyQueue();
+
+    printf("multiple independent queues test passed.\n");
+}
+
+void test_batch_enqueue_dequeue()
+{
+    printf("=== Testing batch enqueue and dequeue ===\n");
+
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free});
+
+        int items[MAX_SIZE];
+        void *batch[MAX_SIZE];
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            items[i] = i;
+            batch[i] = &items[i];
+        }
+        enqueueMany(batch, MAX_SIZE);
+        assert(size() == MAX_SIZE);
+
+        // Drain in uneven batches; order must be preserved across batch boundaries
+        void *out[NUM_OPERATIONS * 3];
+        int expected = 0;
+        while (expected < MAX_SIZE)
+        {
+            size_t taken = dequeueMany(out, NUM_OPERATIONS * 3, 1);
+            assert(taken > 0);
+            for (size_t i = 0; i < taken; i++)
+            {
+                assert(*(int *)out[i] == expected++);
+            }
+        }
+
+        // With min = 0 an empty queue returns immediately
+        assert(dequeueMany(out, NUM_OPERATIONS, 0) == 0);
+        assert(size() == 0);
+        assert(visited() == MAX_SIZE);
+
+        destroyQueue();
+    }
+
+    printf("batch enqueue and dequeue test passed.\n");
+}
+
+int batch_consumer_thread(void *arg)
+{
+    void **out = (void **)arg;
+    // Blocks until a full batch of NUM_OPERATIONS items is available
+    return (int)dequeueMany(out, NUM_OPERATIONS, NUM_OPERATIONS);
+}
+
+void test_blocking_dequeue_many()
+{
+    printf("=== Testing blocking dequeueMany ===\n");
+
+    initQueue();
+
+    void *out[NUM_OPERATIONS];
+    thrd_t consumer;
+    thrd_create(&consumer, batch_consumer_thread, out);
+
+    // Deliver the batch in two bursts, the consumer must keep waiting after the first one
+    int items[NUM_OPERATIONS];
+    void *burst[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        items[i] = i + 1;
+        burst[i] = &items[i];
+    }
+    enqueueMany(burst, NUM_OPERATIONS / 2);
+    thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+    enqueueMany(burst + NUM_OPERATIONS / 2, NUM_OPERATIONS - NUM_OPERATIONS / 2);
+
+    int taken;
+    thrd_join(consumer, &taken);
+    assert(taken == NUM_OPERATIONS);
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        printf("Dequeued in batch: %d\n", *(int *)out[i]);
+        assert(*(int *)out[i] == i + 1);
+    }
+    assert(size() == 0);
+    assert(waiting() == 0);
+
+    destroyQueue();
+
+    printf("blocking dequeueMany test passed.\n");
+}
+
+void test_spurious_wakeups_keep_place()
+{
+    printf("=== Testing spurious wakeups keep waiter place ===\n");
+
+    initQueue();
+
+    thrd_t consumer_threads[NUM_OPERATIONS];
+    int dequeue_order[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        dequeue_order[i] = -1;
+        thrd_create(&consumer_threads[i], consumer_thread, &dequeue_order[i]);
+        thrd_sleep(
+            &(const struct timespec){.tv_nsec = 0.05 * SECOND_IN_NANOSECONDS},
+            NULL);
+    }
+    assert(waiting() == NUM_OPERATIONS);
+
+    // Wake every waiter with nothing to take; each must go back to sleep on its existing node
+    mtx_lock(&default_queue.data_queue.lock);
+    for (struct ThreadNode *waiter = default_queue.thread_queue.first; waiter != NULL; waiter = waiter->next_node)
+    {
+        cnd_signal(waiter->condition_var);
+    }
+    mtx_unlock(&default_queue.data_queue.lock);
+    thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+    assert(waiting() == NUM_OPERATIONS);
+
+    // Feed one item at a time, each wakes exactly the waiter whose turn it is
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        void *item = malloc(sizeof(int));
+        *(int *)item = i + 1;
+        enqueueMany(&item, 1);
+        thrd_sleep(
+            &(const struct timespec){.tv_nsec = 0.05 * SECOND_IN_NANOSECONDS},
+            NULL);
+    }
+
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_join(consumer_threads[i], NULL);
+    }
+    // Arrival order is still honoured after the spurious wakeups
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        printf("Thread %d dequeued item %d\n", i, dequeue_order[i]);
+        assert(dequeue_order[i] == i + 1);
+    }
+    assert(waiting() == 0);
+
+    destroyQueue();
+
+    printf("spurious wakeups keep waiter place test passed.\n");
+}
+
+int spin_consumer_thread(void *arg)
+{
+    void **out = (void **)arg;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        out[i] = dequeue();
+    }
+    return 0;
+}
+
+void test_spin_then_park()
+{
+    printf("=== Testing spin-then-park dequeue ===\n");
+
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free, .spin_ns = SECOND_IN_NANOSECONDS / 1000});
+
+        // A steady stream should be picked up by the spinning consumer, in order
+        int items[MAX_SIZE];
+        void *out[MAX_SIZE];
+        thrd_t consumer;
+        thrd_create(&consumer, spin_consumer_thread, out);
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            items[i] = i;
+            enqueue(&items[i]);
+        }
+        thrd_join(consumer, NULL);
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            assert(*(int *)out[i] == i);
+        }
+
+        // Once the spin budget runs out with nothing arriving, the consumer must still park
+        thrd_t waiter;
+        int taken = 0;
+        thrd_create(&waiter, consumer_thread, &taken);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+        assert(waiting() == 1);
+        int *item = malloc(sizeof(int));
+        *item = 42;
+        enqueue(item);
+        thrd_join(waiter, NULL);
+        assert(taken == 42);
+        assert(size() == 0);
+        assert(waiting() == 0);
+
+        destroyQueue();
+    }
+
+    printf("spin-then-park test passed.\n");
+}
+
+int timed_dequeue_thread(void *arg)
+{
+    (void)arg;
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += 0.1 * SECOND_IN_NANOSECONDS;
+    if (deadline.tv_nsec >= SECOND_IN_NANOSECONDS)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= SECOND_IN_NANOSECONDS;
+    }
+    void *item;
+    return dequeueUntil(&deadline, &item);
+}
+
+void test_dequeue_until()
+{
+    printf("=== Testing dequeueUntil ===\n");
+
+    const struct timespec pause = {.tv_nsec = 0.05 * SECOND_IN_NANOSECONDS};
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free});
+
+        // An empty queue times out and leaves no waiter behind
+        thrd_t timed;
+        int result;
+        thrd_create(&timed, timed_dequeue_thread, NULL);
+        thrd_join(timed, &result);
+        assert(!result);
+        assert(waiting() == 0);
+
+        // Available items are returned even if the deadline already passed
+        int item = 7;
+        void *out = NULL;
+        enqueue(&item);
+        assert(dequeueUntil(&(const struct timespec){0}, &out));
+        assert(out == &item);
+
+        // A waiter timing out in the middle of the line must not hold up the ones behind it
+        thrd_t waiters[3];
+        int taken[3] = {0};
+        thrd_create(&waiters[0], consumer_thread, &taken[0]);
+        thrd_sleep(&pause, NULL);
+        thrd_create(&timed, timed_dequeue_thread, NULL);
+        thrd_sleep(&pause, NULL);
+        for (int i = 1; i < 3; i++)
+        {
+            thrd_create(&waiters[i], consumer_thread, &taken[i]);
+            thrd_sleep(&pause, NULL);
+        }
+        thrd_join(timed, &result);
+        assert(!result);
+        assert(waiting() == 3);
+
+        for (int i = 0; i < 3; i++)
+        {
+            int *value = malloc(sizeof(int));
+            *value = i + 1;
+            enqueue(value);
+            thrd_join(waiters[i], NULL);
+            assert(taken[i] == i + 1);
+        }
+        assert(size() == 0);
+        assert(waiting() == 0);
+
+        destroyQueue();
+    }
+
+    printf("dequeueUntil test passed.\n");
+}
+
+void test_per_thread_stats()
+{
+    printf("=== Testing per-thread statistics ===\n");
+
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free, .per_thread_stats = true});
+
+        // Counts land in many stripes, their sums must still match the totals
+        thrd_t threads[NUM_THREADS];
+        int items_per_thread = NUM_OPERATIONS;
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            thrd_create(&threads[i], enqueueItems, &items_per_thread);
+        }
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            thrd_join(threads[i], NULL);
+        }
+        assert(size() == NUM_THREADS * NUM_OPERATIONS);
+        assert(visited() == 0);
+
+        int taken[NUM_THREADS];
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            thrd_create(&threads[i], consumer_thread, &taken[i]);
+        }
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            thrd_join(threads[i], NULL);
+        }
+        assert(size() == NUM_THREADS * (NUM_OPERATIONS - 1));
+        assert(visited() == NUM_THREADS);
+
+        void *item;
+        while (tryDequeue(&item))
+        {
+            free(item);
+        }
+        assert(size() == 0);
+        assert(visited() == NUM_THREADS * NUM_OPERATIONS);
+
+        destroyQueue();
+    }
+
+    printf("per-thread statistics test passed.\n");
+}
+
+int bounded_producer_thread(void *arg)
+{
+    int *items = (int *)arg;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        enqueue(&items[i]);
+    }
+    return 0;
+}
+
+void test_bounded_queue()
+{
+    printf("=== Testing bounded queue ===\n");
+
+    const size_t capacity = NUM_OPERATIONS / 2;
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free, .capacity = capacity});
+
+        int items[MAX_SIZE];
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            items[i] = i;
+        }
+        for (size_t i = 0; i < capacity; i++)
+        {
+            assert(tryEnqueue(&items[i]));
+        }
+        assert(!tryEnqueue(&items[capacity]));
+        void *item;
+        while (tryDequeue(&item))
+        {
+        }
+
+        // The producer has to wait for the consumer, and the queue never holds more than its capacity
+        thrd_t producer;
+        thrd_create(&producer, bounded_producer_thread, items);
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            assert(size() <= capacity);
+            assert(*(int *)dequeue() == i);
+        }
+        thrd_join(producer, NULL);
+
+        // Batches larger than the capacity go through in pieces
+        void *batch[NUM_OPERATIONS];
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            batch[i] = &items[i];
+        }
+        thrd_t consumer;
+        void *out[NUM_OPERATIONS];
+        thrd_create(&consumer, batch_consumer_thread, out);
+        enqueueMany(batch, NUM_OPERATIONS);
+        thrd_join(consumer, NULL);
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            assert(*(int *)out[i] == i);
+        }
+
+        // A producer parked on a full queue resumes as soon as a consumer makes room
+        for (size_t i = 0; i < capacity; i++)
+        {
+            enqueue(&items[i]);
+        }
+        thrd_create(&producer, enqueue_thread, NULL);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+        assert(default_queue.capacity_limit.producer_queue.count_of_waiting_threads == 1);
+        assert(size() == capacity);
+        assert(*(int *)dequeue() == 0);
+        thrd_join(producer, NULL);
+        assert(size() == capacity);
+        while (tryDequeue(&item))
+        {
+        }
+
+        destroyQueue();
+    }
+
+    printf("bounded queue test passed.\n");
+}
+
+void test_queue_stats()
+{
+    printf("=== Testing queueStats ===\n");
+
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free});
+
+        int items[NUM_OPERATIONS];
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            enqueue(&items[i]);
+        }
+        for (int i = 0; i < NUM_OPERATIONS / 2; i++)
+        {
+            dequeue();
+        }
+
+        // Make one consumer park, so there is something to count
+        thrd_t waiter;
+        int taken = 0;
+        while (size() > 0)
+        {
+            dequeue();
+        }
+        thrd_create(&waiter, consumer_thread, &taken);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+        int *item = malloc(sizeof(int));
+        *item = 5;
+        enqueue(item);
+        thrd_join(waiter, NULL);
+        assert(taken == 5);
+
+        struct queue_stats stats;
+        queueStats(&stats);
+        printf("lock acquisitions: %llu (contended %llu), waits: %llu, spurious: %llu, avg parked: %lluns, avg residency: %lluns\n",
+               (unsigned long long)stats.lock_acquisitions, (unsigned long long)stats.contended_acquisitions, (unsigned long long)stats.waits,
+               (unsigned long long)stats.spurious_wakeups, (unsigned long long)stats.avg_parked_ns, (unsigned long long)stats.avg_residency_ns);
+        assert(stats.size == 0);
+        assert(stats.waiting == 0);
+        assert(stats.visited == NUM_OPERATIONS + 1);
+#ifdef QUEUE_STATS
+        assert(stats.waits >= 1);
+        assert(stats.lock_acquisitions >= stats.contended_acquisitions);
+        assert(stats.avg_parked_ns > 0);
+#else
+        assert(stats.waits == 0);
+#endif
+
+        destroyQueue();
+    }
+
+    printf("queueStats test passed.\n");
+}
+
+int sharded_producer_thread(void *arg)
+{
+    struct ShardedItem *items = (struct ShardedItem *)arg;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        enqueue(&items[i]);
+    }
+    return 0;
+}
+
+void test_sharded_queue()
+{
+    printf("=== Testing sharded queue ===\n");
+
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free, .shards = NUM_SHARDS});
+
+        // Each producer lands in one shard, so its items must come out in order and exactly once
+        static struct ShardedItem items[NUM_SHARDS][MAX_SIZE];
+        thrd_t producers[NUM_SHARDS];
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            for (int i = 0; i < MAX_SIZE; i++)
+            {
+                items[p][i] = (struct ShardedItem){.producer = p, .sequence = i};
+            }
+            thrd_create(&producers[p], sharded_producer_thread, items[p]);
+        }
+        int next_expected[NUM_SHARDS] = {0};
+        for (int i = 0; i < NUM_SHARDS * MAX_SIZE; i++)
+        {
+            struct ShardedItem *item = (struct ShardedItem *)dequeue();
+            assert(item->sequence == next_expected[item->producer]);
+            next_expected[item->producer]++;
+        }
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            thrd_join(producers[p], NULL);
+            assert(next_expected[p] == MAX_SIZE);
+        }
+        assert(size() == 0);
+        assert(visited() == NUM_SHARDS * MAX_SIZE);
+
+        // A consumer parked on an empty sharded queue is woken by an enqueue into any shard
+        thrd_t waiter;
+        int taken = 0;
+        thrd_create(&waiter, consumer_thread, &taken);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+        assert(waiting() == 1);
+        int *item = malloc(sizeof(int));
+        *item = 3;
+        enqueue(item);
+        thrd_join(waiter, NULL);
+        assert(taken == 3);
+        assert(waiting() == 0);
+
+        destroyQueue();
+    }
+
+    printf("sharded queue test passed.\n");
+}
+
+void test_priority_lanes()
+{
+    printf("=== Testing priority lanes ===\n");
+
+    initQueue();
+
+    // Urgent items overtake normal ones, and each lane stays FIFO
+    int items[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        items[i] = i;
+    }
+    enqueue(&items[0]);
+    enqueuePriority(&items[1], 1);
+    enqueue(&items[2]);
+    enqueuePriority(&items[3], QUEUE_PRIORITY_LANES + 5);
+    enqueuePriority(&items[4], 1);
+    enqueuePriority(&items[5], QUEUE_PRIORITY_LANES - 1);
+    enqueuePriority(&items[6], -1);
+    const int expected[] = {3, 5, 1, 4, 0, 2, 6};
+    void *batch[2];
+    assert(dequeueMany(batch, 2, 2) == 2);
+    assert(*(int *)batch[0] == expected[0]);
+    assert(*(int *)batch[1] == expected[1]);
+    for (size_t i = 2; i < sizeof(expected) / sizeof(expected[0]); i++)
+    {
+        void *item;
+        assert(tryDequeue(&item));
+        assert(*(int *)item == expected[i]);
+    }
+    assert(size() == 0);
+    assert(visited() == 7);
+
+    // A parked consumer is still woken in turn by a priority item
+    thrd_t waiter;
+    int taken = 0;
+    thrd_create(&waiter, consumer_thread, &taken);
+    thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+    assert(waiting() == 1);
+    int *item = malloc(sizeof(int));
+    *item = 9;
+    enqueuePriority(item, 2);
+    thrd_join(waiter, NULL);
+    assert(taken == 9);
+    assert(waiting() == 0);
+
+    // Urgent items taken ahead of older ones still count as turns, so no parked consumer is left next to a queued item
+    for (int round = 0; round < NUM_OPERATIONS; round++)
+    {
+        thrd_t waiters[4];
+        int values[4] = {0};
+        for (int i = 0; i < 4; i++)
+        {
+            thrd_create(&waiters[i], consumer_thread, &values[i]);
+        }
+        while (waiting() < 4)
+        {
+            thrd_yield();
+        }
+        void *backlog[2];
+        for (int i = 0; i < 2; i++)
+        {
+            backlog[i] = malloc(sizeof(int));
+            *(int *)backlog[i] = i + 1;
+        }
+        enqueueMany(backlog, 2);
+        int *urgent = malloc(sizeof(int));
+        *urgent = 3;
+        enqueuePriority(urgent, 3);
+        // Three items for four consumers: three must get theirs without any further enqueue
+        time_t give_up = time(NULL) + 5;
+        while ((waiting() > 1 || size() > 0) && time(NULL) < give_up)
+        {
+            thrd_yield();
+        }
+        assert(size() == 0);
+        assert(waiting() == 1);
+        int *last = malloc(sizeof(int));
+        *last = 4;
+        enqueue(last);
+        int sum = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            thrd_join(waiters[i], NULL);
+            sum += values[i];
+        }
+        assert(sum == 1 + 2 + 3 + 4);
+    }
+
+    destroyQueue();
+
+    printf("priority lanes test passed.\n");
+}
+
+void test_targeted_wakeups()
+{
+    printf("=== Testing targeted wakeups ===\n");
+
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free});
+
+        // Back-to-back enqueues skip waiters whose wakeup is still pending, yet every parked consumer must get its item
+        thrd_t waiters[NUM_OPERATIONS];
+        int taken[NUM_OPERATIONS] = {0};
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            thrd_create(&waiters[i], consumer_thread, &taken[i]);
+        }
+        while (waiting() < NUM_OPERATIONS)
+        {
+            thrd_yield();
+        }
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            int *item = malloc(sizeof(int));
+            *item = i + 1;
+            enqueue(item);
+        }
+        int sum = 0;
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            thrd_join(waiters[i], NULL);
+            sum += taken[i];
+        }
+        assert(sum == NUM_OPERATIONS * (NUM_OPERATIONS + 1) / 2);
+        assert(size() == 0);
+        assert(waiting() == 0);
+
+        destroyQueue();
+    }
+
+    printf("targeted wakeups test passed.\n");
+}
+
+int node_consumer_thread(void *arg)
+{
+    struct queue_link *link = dequeueNode();
+    *(int *)arg = ((struct LinkedItem *)((char *)link - offsetof(struct LinkedItem, link)))->value;
+    return 0;
+}
+
+void test_intrusive_nodes()
+{
+    printf("=== Testing intrusive nodes ===\n");
+
+    for (int lock_free = 0; lock_free <= 1; lock_free++)
+    {
+        initQueueWithOpts(&(struct queue_opts){.lock_free = lock_free});
+
+        // Links come back in FIFO order as the very memory that was enqueued
+        struct LinkedItem items[NUM_OPERATIONS];
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            items[i].value = i;
+            enqueueNode(&items[i].link);
+        }
+        assert(size() == NUM_OPERATIONS);
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            assert(dequeueNode() == &items[i].link);
+        }
+
+        // A consumer blocked in dequeueNode is woken by enqueueNode
+        thrd_t waiter;
+        int taken = -1;
+        thrd_create(&waiter, node_consumer_thread, &taken);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+        assert(waiting() == 1);
+        items[0].value = 42;
+        enqueueNode(&items[0].link);
+        thrd_join(waiter, NULL);
+        assert(taken == 42);
+
+        // Links left in the queue stay owned by the caller when the queue is destroyed
+        enqueueNode(&items[1].link);
+        enqueueNode(&items[2].link);
+        assert(visited() == NUM_OPERATIONS + 1);
+        destroyQueue();
+        assert(items[1].value == 1 && items[2].value == 2);
+    }
+
+    printf("intrusive nodes test passed.\n");
+}
+
+int closing_consumer_thread(void *arg)
+{
+    *(void **)arg = dequeue();
+    return 0;
+}
+
+// Fills the producer's own shard, or the whole single queue, before the second enqueue has to park.
+int filling_producer_thread(void *arg)
+{
+    static int items[2];
+    bool *accepted = (bool *)arg;
+    accepted[0] = enqueue(&items[0]);
+    accepted[1] = enqueue(&items[1]);
+    return 0;
+}
+
+// Enqueues until the close refuses it, counting what was accepted.
+int racing_producer_thread(void *arg)
+{
+    static int item;
+    atomic_int *accepted = (atomic_int *)arg;
+    while (enqueue(&item))
+    {
+        (*accepted)++;
+    }
+    return 0;
+}
+
+int racing_consumer_thread(void *arg)
+{
+    atomic_int *taken = (atomic_int *)arg;
+    while (dequeue() != QUEUE_CLOSED)
+    {
+        (*taken)++;
+    }
+    return 0;
+}
+
+void test_close_queue()
+{
+    printf("=== Testing closeQueue ===\n");
+
+    const struct queue_opts modes[] = {{.lock_free = false}, {.lock_free = true}, {.shards = NUM_SHARDS}};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        initQueueWithOpts(&modes[m]);
+
+        // Items queued before the close are still drained, and only then does dequeue report QUEUE_CLOSED
+        int items[NUM_OPERATIONS];
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            assert(enqueue(&items[i]));
+        }
+        closeQueue();
+        assert(!enqueue(&items[0]));
+        assert(!tryEnqueue(&items[0]));
+        assert(!enqueueMany((void *[]){&items[0], &items[1]}, 2));
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            assert(dequeue() == &items[i]);
+        }
+        assert(size() == 0);
+        assert(dequeue() == QUEUE_CLOSED);
+        void *item = NULL;
+        assert(!tryDequeue(&item) && item == QUEUE_CLOSED);
+        destroyQueue();
+
+        // Parked consumers are all released by the close instead of waiting for destroyQueue
+        initQueueWithOpts(&modes[m]);
+        thrd_t consumers[NUM_OPERATIONS];
+        void *results[NUM_OPERATIONS];
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            thrd_create(&consumers[i], closing_consumer_thread, &results[i]);
+        }
+        while (waiting() < NUM_OPERATIONS)
+        {
+            thrd_yield();
+        }
+        closeQueue();
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            thrd_join(consumers[i], NULL);
+            assert(results[i] == QUEUE_CLOSED);
+        }
+        assert(waiting() == 0);
+        destroyQueue();
+    }
+
+    // A producer parked on a full queue, or on a full shard, gets a failure back
+    const struct queue_opts bounded_modes[] = {{.capacity = 1}, {.capacity = 1, .shards = NUM_SHARDS}};
+    for (size_t m = 0; m < sizeof(bounded_modes) / sizeof(bounded_modes[0]); m++)
+    {
+        initQueueWithOpts(&bounded_modes[m]);
+        thrd_t producer;
+        bool accepted[2] = {false, true};
+        thrd_create(&producer, filling_producer_thread, accepted);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+        closeQueue();
+        thrd_join(producer, NULL);
+        assert(accepted[0] && !accepted[1]);
+        assert(size() == 1);
+        void *first = dequeue();
+        assert(first != NULL && first != QUEUE_CLOSED);
+        assert(dequeue() == QUEUE_CLOSED);
+        destroyQueue();
+    }
+
+    // A close racing busy producers loses nothing: whatever an enqueue accepted is still dequeued
+    const struct queue_opts racing_modes[] = {{.lock_free = false}, {.capacity = 8}, {.shards = NUM_SHARDS}, {.lock_free = true}};
+    for (size_t m = 0; m < sizeof(racing_modes) / sizeof(racing_modes[0]); m++)
+    {
+        initQueueWithOpts(&racing_modes[m]);
+        atomic_int accepted = 0;
+        atomic_int taken = 0;
+        thrd_t producers[NUM_SHARDS];
+        thrd_t consumers[NUM_SHARDS];
+        for (int i = 0; i < NUM_SHARDS; i++)
+        {
+            thrd_create(&producers[i], racing_producer_thread, &accepted);
+            thrd_create(&consumers[i], racing_consumer_thread, &taken);
+        }
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.05 * SECOND_IN_NANOSECONDS}, NULL);
+        closeQueue();
+        for (int i = 0; i < NUM_SHARDS; i++)
+        {
+            thrd_join(producers[i], NULL);
+            thrd_join(consumers[i], NULL);
+        }
+        assert(taken == accepted);
+        assert(size() == 0);
+        destroyQueue();
+    }
+
+    // A lock-free or SPSC producer that passed its closed check before the close still gets its item to a consumer, who only sees QUEUE_CLOSED after it
+    const struct queue_opts unlocked_modes[] = {{.lock_free = true}, {.spsc = true}};
+    for (size_t m = 0; m < sizeof(unlocked_modes) / sizeof(unlocked_modes[0]); m++)
+    {
+        initQueueWithOpts(&unlocked_modes[m]);
+        assert(enter_enqueue(&default_queue));
+        closeQueue();
+        thrd_t consumer;
+        int consumed = 0;
+        thrd_create(&consumer, consumer_thread, &consumed);
+        while (waiting() < 1)
+        {
+            thrd_yield();
+        }
+        int *item = malloc(sizeof(int));
+        *item = 7;
+        append_item(&default_queue, item);
+        leave_enqueue(&default_queue);
+        thrd_join(consumer, NULL);
+        assert(consumed == 7);
+        assert(dequeue() == QUEUE_CLOSED);
+        destroyQueue();
+
+        // One that finds nothing to push after all still releases the waiters
+        initQueueWithOpts(&unlocked_modes[m]);
+        assert(enter_enqueue(&default_queue));
+        closeQueue();
+        atomic_int none = 0;
+        thrd_create(&consumer, racing_consumer_thread, &none);
+        while (waiting() < 1)
+        {
+            thrd_yield();
+        }
+        leave_enqueue(&default_queue);
+        thrd_join(consumer, NULL);
+        assert(none == 0);
+        destroyQueue();
+    }
+
+    printf("closeQueue test passed.\n");
+}
+
+int spsc_producer_thread(void *arg)
+{
+    int *items = (int *)arg;
+    // Spans several ring segments, mixing single and batched enqueues
+    for (int i = 0; i < 4 * SPSC_SEGMENT_SLOTS; i += 4)
+    {
+        enqueue(&items[i]);
+        enqueueMany((void *[]){&items[i + 1], &items[i + 2], &items[i + 3]}, 3);
+    }
+    return 0;
+}
+
+void test_spsc_queue()
+{
+    printf("=== Testing SPSC queue ===\n");
+
+    initQueueWithOpts(&(struct queue_opts){.spsc = true});
+
+    static int items[4 * SPSC_SEGMENT_SLOTS];
+    for (int i = 0; i < 4 * SPSC_SEGMENT_SLOTS; i++)
+    {
+        items[i] = i;
+    }
+    thrd_t producer;
+    thrd_create(&producer, spsc_producer_thread, items);
+    for (int i = 0; i < 4 * SPSC_SEGMENT_SLOTS; i++)
+    {
+        void *item;
+        // Alternate between the blocking and the non-blocking dequeue
+        if (i % 2 == 0)
+        {
+            item = dequeue();
+        }
+        else
+        {
+            while (!tryDequeue(&item))
+            {
+                thrd_yield();
+            }
+        }
+        assert(*(int *)item == i);
+    }
+    thrd_join(producer, NULL);
+    assert(size() == 0);
+    assert(visited() == 4 * SPSC_SEGMENT_SLOTS);
+
+    // The consumer parks on an empty queue and is woken by the producer
+    thrd_t waiter;
+    int taken = 0;
+    thrd_create(&waiter, consumer_thread, &taken);
+    thrd_sleep(&(const struct timespec){.tv_nsec = 0.1 * SECOND_IN_NANOSECONDS}, NULL);
+    assert(waiting() == 1);
+    int *item = malloc(sizeof(int));
+    *item = 7;
+    enqueue(item);
+    thrd_join(waiter, NULL);
+    assert(taken == 7);
+
+    closeQueue();
+    assert(dequeue() == QUEUE_CLOSED);
+    destroyQueue();
+
+    printf("SPSC queue test passed.\n");
+}
+
+void test_direct_handoff()
+{
+    printf("=== Testing direct handoff ===\n");
+
+    initQueue();
+
+    // Consumers park one after another, and each item goes to the longest-waiting one
+    thrd_t waiters[NUM_OPERATIONS];
+    int taken[NUM_OPERATIONS] = {0};
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_create(&waiters[i], consumer_thread, &taken[i]);
+        while (waiting() < (size_t)i + 1)
+        {
+            thrd_yield();
+        }
+    }
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        int *item = malloc(sizeof(int));
+        *item = i + 1;
+        // Every path that adds a single item hands it over
+        if (i % 2 == 0)
+        {
+            enqueue(item);
+        }
+        else
+        {
+            enqueuePriority(item, 1);
+        }
+        assert(size() == 0);
+    }
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_join(waiters[i], NULL);
+        assert(taken[i] == i + 1);
+    }
+    assert(visited() == NUM_OPERATIONS);
+    assert(waiting() == 0);
+
+    destroyQueue();
+
+    printf("direct handoff test passed.\n");
+}
+
+void test_sequence_wraparound()
+{
+    printf("=== Testing sequence wraparound ===\n");
+
+    initQueue();
+    // Start just short of the wrap, so tickets and item indices cross it below
+    default_queue.data_queue.added_count = UINT64_MAX - 2;
+    default_queue.data_queue.processed_count = UINT64_MAX - 2;
+
+    thrd_t waiters[NUM_OPERATIONS];
+    int taken[NUM_OPERATIONS] = {0};
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_create(&waiters[i], consumer_thread, &taken[i]);
+    }
+    while (waiting() < NUM_OPERATIONS)
+    {
+        thrd_yield();
+    }
+    // A batch goes through the data list, so the waiters compare their tickets against indices on both sides of the wrap
+    void *batch[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        int *item = malloc(sizeof(int));
+        *item = i + 1;
+        batch[i] = item;
+    }
+    enqueueMany(batch, NUM_OPERATIONS);
+    int sum = 0;
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_join(waiters[i], NULL);
+        sum += taken[i];
+    }
+    assert(sum == NUM_OPERATIONS * (NUM_OPERATIONS + 1) / 2);
+    assert(waiting() == 0);
+    assert(size() == 0);
+
+    // FIFO order holds past the wrap as well
+    int items[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        enqueue(&items[i]);
+    }
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        assert(dequeue() == &items[i]);
+    }
+
+    destroyQueue();
+
+    printf("sequence wraparound test passed.\n");
+}
+
+void test_pollable_queue()
+{
+    printf("=== Testing pollable queue ===\n");
+
+    // The mutex, lock-free and SPSC paths all signal the handle
+    const struct queue_opts modes[] = {{.pollable = true}, {.pollable = true, .lock_free = true}, {.pollable = true, .spsc = true}};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        initQueueWithOpts(&modes[m]);
+        struct pollfd handle = {.fd = queueNotifyFd(), .events = POLLIN};
+        assert(handle.fd >= 0);
+        assert(poll(&handle, 1, 0) == 0);
+
+        // A burst makes the handle readable once, and a rearm with the items still queued leaves it quiet
+        int items[NUM_OPERATIONS];
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            enqueue(&items[i]);
+        }
+        assert(poll(&handle, 1, 0) == 1 && (handle.revents & POLLIN));
+        queueNotifyRearm();
+        assert(poll(&handle, 1, 0) == 0);
+        void *item;
+        for (int i = 0; i < NUM_OPERATIONS; i++)
+        {
+            assert(tryDequeue(&item) && item == &items[i]);
+        }
+        assert(!tryDequeue(&item));
+
+        // The next arrival signals again
+        enqueueMany((void *[]){&items[0], &items[1]}, 2);
+        assert(poll(&handle, 1, 0) == 1);
+        destroyQueue();
+    }
+
+    // An event loop polls, rearms and drains without ever blocking in dequeue
+    initQueueWithOpts(&(struct queue_opts){.pollable = true});
+    static int items[4 * SPSC_SEGMENT_SLOTS];
+    for (int i = 0; i < 4 * SPSC_SEGMENT_SLOTS; i++)
+    {
+        items[i] = i;
+    }
+    thrd_t producer;
+    thrd_create(&producer, spsc_producer_thread, items);
+    struct pollfd handle = {.fd = queueNotifyFd(), .events = POLLIN};
+    int received = 0;
+    while (received < 4 * SPSC_SEGMENT_SLOTS)
+    {
+        assert(poll(&handle, 1, 5000) == 1);
+        queueNotifyRearm();
+        void *item;
+        while (tryDequeue(&item))
+        {
+            assert(*(int *)item == received);
+            received++;
+        }
+    }
+    thrd_join(producer, NULL);
+
+    // Closing wakes the loop too, which then finds the queue drained
+    closeQueue();
+    assert(poll(&handle, 1, 0) == 1);
+    void *item;
+    assert(!tryDequeue(&item) && item == QUEUE_CLOSED);
+    destroyQueue();
+
+    // Queues that did not ask for it have no handle
+    initQueue();
+    assert(queueNotifyFd() == -1);
+    destroyQueue();
+
+    printf("pollable queue test passed.\n");
+}
+
+int record_drained_batch(void **items, size_t count, void *ctx)
+{
+    struct DrainLog *log = (struct DrainLog *)ctx;
+    for (size_t i = 0; i < count; i++)
+    {
+        log->seen[log->count++] = (int *)items[i];
+    }
+    if (count > log->largest_batch)
+    {
+        log->largest_batch = count;
+    }
+    return log->stop_after != 0 && log->count >= log->stop_after;
+}
+
+int drain_thread(void *arg)
+{
+    return (int)drainQueue(record_drained_batch, arg, 16);
+}
+
+void test_drain_queue()
+{
+    printf("=== Testing drainQueue ===\n");
+
+    // Everything queued goes out in one drain, most urgent first, and a stop puts back what the callback did not see
+    initQueue();
+    int items[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS - 1; i++)
+    {
+        enqueue(&items[i]);
+    }
+    enqueuePriority(&items[NUM_OPERATIONS - 1], 2);
+    static struct DrainLog log;
+    log = (struct DrainLog){.stop_after = 7};
+    assert(drainQueue(record_drained_batch, &log, 3) == 9);
+    assert(log.count == 9 && log.largest_batch == 3);
+    assert(log.seen[0] == &items[NUM_OPERATIONS - 1]);
+    for (int i = 1; i < 9; i++)
+    {
+        assert(log.seen[i] == &items[i - 1]);
+    }
+    assert(size() == 1);
+    assert(visited() == 9);
+    // The put-back item stays ahead of newer ones
+    enqueue(&items[0]);
+    assert(dequeue() == &items[NUM_OPERATIONS - 2]);
+    assert(dequeue() == &items[0]);
+    destroyQueue();
+
+    // Batches of one, or of 0 which means one, deliver each item on its own
+    for (size_t max_batch = 0; max_batch <= 1; max_batch++)
+    {
+        initQueue();
+        for (int i = 0; i < 3; i++)
+        {
+            enqueue(&items[i]);
+        }
+        log = (struct DrainLog){.stop_after = 3};
+        assert(drainQueue(record_drained_batch, &log, max_batch) == 3);
+        assert(log.count == 3 && log.largest_batch == 1);
+        for (int i = 0; i < 3; i++)
+        {
+            assert(log.seen[i] == &items[i]);
+        }
+        assert(size() == 0);
+        destroyQueue();
+    }
+
+    // A drainer blocks while the queue is empty and returns once it is closed and drained
+    const struct queue_opts modes[] = {{.lock_free = false}, {.lock_free = true}, {.capacity = 4}, {.spsc = true}, {.shards = NUM_SHARDS}};
+    static int produced[4 * SPSC_SEGMENT_SLOTS];
+    for (int i = 0; i < 4 * SPSC_SEGMENT_SLOTS; i++)
+    {
+        produced[i] = i;
+    }
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        initQueueWithOpts(&modes[m]);
+        log = (struct DrainLog){0};
+        thrd_t drainer;
+        thrd_t producer;
+        thrd_create(&drainer, drain_thread, &log);
+        thrd_create(&producer, spsc_producer_thread, produced);
+        thrd_join(producer, NULL);
+        closeQueue();
+        int drained;
+        thrd_join(drainer, &drained);
+        assert(drained == 4 * SPSC_SEGMENT_SLOTS);
+        for (int i = 0; i < 4 * SPSC_SEGMENT_SLOTS; i++)
+        {
+            assert(*log.seen[i] == i);
+        }
+        assert(log.largest_batch <= 16);
+        assert(size() == 0);
+        destroyQueue();
+    }
+
+    printf("drainQueue test passed.\n");
+}
+
+void test_numa_sharded_queue()
+{
+    printf("=== Testing NUMA-aware sharded queue ===\n");
+
+    initQueueWithOpts(&(struct queue_opts){.shards = NUM_SHARDS, .numa_nodes = 2});
+    size_t node = current_numa_node() % 2;
+
+    // Enqueues stay on the shards of our own node
+    int items[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        enqueue(&items[i]);
+    }
+    for (size_t shard = 0; shard < NUM_SHARDS; shard++)
+    {
+        assert(shard % 2 == node || queue_size(&default_queue.shards[shard]) == 0);
+    }
+    // An item on the other node is only stolen once ours are drained
+    int remote_item;
+    queue_enqueue(&default_queue.shards[1 - node], &remote_item);
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        assert(dequeue() == &items[i]);
+    }
+    assert(dequeue() == &remote_item);
+    struct queue_stats stats;
+    queueStats(&stats);
+#ifdef QUEUE_STATS
+    assert(stats.numa_local_dequeues[node] == NUM_OPERATIONS);
+    assert(stats.numa_remote_dequeues[node] == 1);
+#else
+    assert(stats.numa_local_dequeues[node] == 0);
+#endif
+
+    // A producer wakes a waiter on its own node ahead of one parked on the other node
+    thrd_t waiters[2];
+    int taken[2] = {0};
+    for (int i = 0; i < 2; i++)
+    {
+        thrd_create(&waiters[i], consumer_thread, &taken[i]);
+        while (waiting() < (size_t)i + 1)
+        {
+            thrd_yield();
+        }
+    }
+    mtx_lock(&default_queue.data_queue.lock);
+    default_queue.thread_queue.first->numa_node = 1 - node;
+    mtx_unlock(&default_queue.data_queue.lock);
+    int *item = malloc(sizeof(int));
+    *item = 1;
+    enqueue(item);
+    thrd_join(waiters[1], NULL);
+    assert(taken[1] == 1);
+    assert(waiting() == 1);
+    // With nobody else on our node, the passed-over waiter is next
+    item = malloc(sizeof(int));
+    *item = 2;
+    enqueue(item);
+    thrd_join(waiters[0], NULL);
+    assert(taken[0] == 2);
+    assert(size() == 0);
+
+    // While consumers dequeue only on the other node, a producer fills that node's shards instead of its own
+    atomic_store(&default_queue.node_consumers[1 - node].active, 1);
+    enqueue(&items[0]);
+    for (size_t shard = 0; shard < NUM_SHARDS; shard++)
+    {
+        assert(queue_size(&default_queue.shards[shard]) == (shard == 1 - node ? 1 : 0));
+    }
+    atomic_store(&default_queue.node_consumers[1 - node].active, 0);
+    assert(dequeue() == &items[0]);
+
+    destroyQueue();
+
+    // Preallocated nodes are only carved out once a producer uses the shard, so first touch happens on the producer's node
+    const struct queue_opts preallocated[] = {{.shards = NUM_SHARDS, .numa_nodes = 2, .prealloc = 1000}, {.shards = NUM_SHARDS, .numa_nodes = 2, .capacity = 1000}};
+    for (size_t m = 0; m < sizeof(preallocated) / sizeof(preallocated[0]); m++)
+    {
+        initQueueWithOpts(&preallocated[m]);
+        for (size_t shard = 0; shard < NUM_SHARDS; shard++)
+        {
+            assert(default_queue.shards[shard].node_pool.chunk_count == 0);
+        }
+        enqueue(&items[0]);
+        size_t carved = 0;
+        for (size_t shard = 0; shard < NUM_SHARDS; shard++)
+        {
+            struct NodePool *pool = &default_queue.shards[shard].node_pool;
+            if (pool->chunk_count > 0)
+            {
+                // The first shortage carves the whole preallocation at once
+                assert(shard % 2 == node && pool->deferred_prealloc == 0);
+                assert(((((uint64_t)1 << pool->chunk_count) - 1) << NODE_POOL_FIRST_CHUNK_SHIFT) >= 1000);
+                carved++;
+            }
+        }
+        assert(carved == 1);
+        assert(dequeue() == &items[0]);
+        destroyQueue();
+    }
+
+    // A consumer waiting on the queue carves the shards of its own node before anything is enqueued
+    initQueueWithOpts(&preallocated[0]);
+    thrd_t consumer;
+    int consumed = 0;
+    thrd_create(&consumer, consumer_thread, &consumed);
+    while (waiting() < 1)
+    {
+        thrd_yield();
+    }
+    for (size_t shard = 0; shard < NUM_SHARDS; shard++)
+    {
+        assert((default_queue.shards[shard].node_pool.chunk_count > 0) == (shard % 2 == node));
+    }
+    item = malloc(sizeof(int));
+    *item = 3;
+    enqueue(item);
+    thrd_join(consumer, NULL);
+    assert(consumed == 3);
+    destroyQueue();
+
+    printf("NUMA-aware sharded queue test passed.\n");
+}
+
+// Marks every item it takes in a shared table, so the test can check that each one was delivered exactly once.
+int barging_consumer_thread(void *arg)
+{
+    atomic_int(*seen)[MAX_SIZE] = (atomic_int(*)[MAX_SIZE])arg;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        struct ShardedItem *item = (struct ShardedItem *)dequeue();
+        seen[item->producer][item->sequence]++;
+    }
+    return 0;
+}
+
+void test_barging_policy()
+{
+    printf("=== Testing barging wakeup policy ===\n");
+
+    const struct queue_opts modes[] = {{.wakeup = QUEUE_BARGING}, {.wakeup = QUEUE_BARGING, .lock_free = true}, {.wakeup = QUEUE_BARGING, .shards = NUM_SHARDS}};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        initQueueWithOpts(&modes[m]);
+
+        // Producers and consumers race freely, yet every item comes out exactly once
+        static struct ShardedItem items[NUM_SHARDS][MAX_SIZE];
+        static atomic_int seen[NUM_SHARDS][MAX_SIZE];
+        thrd_t producers[NUM_SHARDS];
+        thrd_t consumers[NUM_SHARDS];
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            for (int i = 0; i < MAX_SIZE; i++)
+            {
+                items[p][i] = (struct ShardedItem){.producer = p, .sequence = i};
+                seen[p][i] = 0;
+            }
+        }
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            thrd_create(&consumers[p], barging_consumer_thread, seen);
+            thrd_create(&producers[p], sharded_producer_thread, items[p]);
+        }
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            thrd_join(producers[p], NULL);
+            thrd_join(consumers[p], NULL);
+        }
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            for (int i = 0; i < MAX_SIZE; i++)
+            {
+                assert(seen[p][i] == 1);
+            }
+        }
+        assert(size() == 0);
+        assert(waiting() == 0);
+
+        destroyQueue();
+    }
+
+    // A parked consumer is not handed the item, so a running one can still take it
+    initQueueWithOpts(&(struct queue_opts){.wakeup = QUEUE_BARGING});
+    thrd_t waiter;
+    int taken = 0;
+    thrd_create(&waiter, consumer_thread, &taken);
+    while (waiting() < 1)
+    {
+        thrd_yield();
+    }
+    int item;
+    mtx_lock(&default_queue.data_queue.lock);
+    assert(!hand_off_to_waiter(&default_queue, &item));
+    mtx_unlock(&default_queue.data_queue.lock);
+    // Several items still wake the parked consumer, which takes one and leaves the rest
+    int *first = malloc(sizeof(int));
+    int *second = malloc(sizeof(int));
+    *first = 5;
+    *second = 6;
+    enqueueMany((void *[]){first, second}, 2);
+    thrd_join(waiter, NULL);
+    assert(taken == 5);
+    assert(size() == 1);
+    void *rest;
+    assert(tryDequeue(&rest) && rest == second);
+    free(second);
+    destroyQueue();
+
+    printf("barging wakeup policy test passed.\n");
+}
+
+#ifdef QUEUE_HAVE_SHM
+void test_shared_memory_queue()
+{
+    printf("=== Testing shared-memory queue ===\n");
+
+    char name[64];
+    snprintf(name, sizeof(name), "/queue_test_%ld", (long)getpid());
+    // Small enough that the producer keeps running into a full queue
+    queue_shm_t *q = queue_shm_open(name, 4, sizeof(struct ShardedItem));
+    assert(q != NULL);
+    assert(queue_shm_size(q) == 0);
+    // Attaching with another geometry is refused
+    assert(queue_shm_open(name, 8, sizeof(struct ShardedItem)) == NULL);
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        // The producer process attaches by name, like an unrelated program would
+        queue_shm_t *producer = queue_shm_open(name, 4, sizeof(struct ShardedItem));
+        for (int i = 0; producer != NULL && i < MAX_SIZE; i++)
+        {
+            struct ShardedItem item = {.producer = 1, .sequence = i};
+            queue_shm_enqueue(producer, &item);
+        }
+        if (producer != NULL)
+        {
+            queue_shm_close(producer);
+            queue_shm_detach(producer);
+        }
+        _exit(producer != NULL ? 0 : 1);
+    }
+    assert(child > 0);
+    struct ShardedItem item;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        bool taken = i % 2 == 0 ? queue_shm_dequeue(q, &item) : queue_shm_dequeue_until(q, &(struct timespec){.tv_sec = time(NULL) + 10}, &item);
+        assert(taken);
+        assert(item.producer == 1 && item.sequence == i);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    // The producer closed the queue on its way out
+    assert(!queue_shm_dequeue(q, &item));
+    assert(!queue_shm_try_enqueue(q, &item));
+
+    queue_shm_detach(q);
+    assert(queue_shm_unlink(name));
+
+    // Within one process it behaves like a bounded queue
+    q = queue_shm_open(name, 2, sizeof(int));
+    int value = 1;
+    assert(queue_shm_try_enqueue(q, &value));
+    value = 2;
+    assert(queue_shm_try_enqueue(q, &value));
+    assert(!queue_shm_try_enqueue(q, &value));
+    assert(queue_shm_try_dequeue(q, &value) && value == 1);
+    assert(queue_shm_try_dequeue(q, &value) && value == 2);
+    assert(!queue_shm_try_dequeue(q, &value));
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += 0.05 * SECOND_IN_NANOSECONDS;
+    if (deadline.tv_nsec >= SECOND_IN_NANOSECONDS)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= SECOND_IN_NANOSECONDS;
+    }
+    assert(!queue_shm_dequeue_until(q, &deadline, &value));
+
+#ifdef QUEUE_HAVE_ROBUST_MUTEX
+    // A process killed while it holds the lock does not take the queue down with it
+    value = 3;
+    assert(queue_shm_try_enqueue(q, &value));
+    child = fork();
+    if (child == 0)
+    {
+        queue_shm_t *holder = queue_shm_open(name, 2, sizeof(int));
+        if (holder != NULL)
+        {
+            pthread_mutex_lock(&holder->header->lock);
+            raise(SIGKILL);
+        }
+        _exit(1);
+    }
+    assert(child > 0);
+    assert(waitpid(child, &status, 0) == child && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+    assert(queue_shm_size(q) == 1);
+    assert(queue_shm_try_dequeue(q, &value) && value == 3);
+    value = 4;
+    assert(queue_shm_try_enqueue(q, &value));
+    assert(queue_shm_try_dequeue(q, &value) && value == 4);
+#endif
+    queue_shm_detach(q);
+    queue_shm_unlink(name);
+
+    // An object whose creator never finished setting it up is given up on instead of waited for forever
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    assert(fd >= 0 && ftruncate(fd, 4096) == 0);
+    assert(queue_shm_open(name, 2, sizeof(int)) == NULL);
+    close(fd);
+    queue_shm_unlink(name);
+
+    printf("shared-memory queue test passed.\n");
+}
+#endif
+
+int copy_consumer_thread(void *arg)
+{
+    int *taken = (int *)arg;
+    struct ShardedItem item;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        assert(dequeueCopy(&item) == &item);
+        // One producer fills one shard, so even the sharded queue hands its copies back in order
+        assert(item.producer == 1 && item.sequence == i);
+        (*taken)++;
+    }
+    return 0;
+}
+
+void test_inline_payload_queue()
+{
+    printf("=== Testing inline payload copies ===\n");
+
+    const struct queue_opts modes[] = {{.inline_size = sizeof(struct ShardedItem)}, {.inline_size = sizeof(struct ShardedItem), .lock_free = true}, {.inline_size = sizeof(struct ShardedItem), .spsc = true}, {.inline_size = sizeof(struct ShardedItem), .shards = NUM_SHARDS}, {.inline_size = sizeof(struct ShardedItem), .capacity = 8}};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        initQueueWithOpts(&modes[m]);
+
+        // The producer reuses one stack variable, so the consumer can only see the right sequence if each enqueue copied it
+        thrd_t consumer;
+        int taken = 0;
+        thrd_create(&consumer, copy_consumer_thread, &taken);
+        struct ShardedItem item = {.producer = 1};
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            item.sequence = i;
+            assert(enqueueCopy(&item, sizeof(item)));
+        }
+        thrd_join(consumer, NULL);
+        assert(taken == MAX_SIZE);
+        assert(size() == 0);
+
+        // Payloads larger than inline_size are refused, shorter ones come out zero-padded
+        char oversized[sizeof(struct ShardedItem) + 1] = {0};
+        assert(!enqueueCopy(oversized, sizeof(oversized)));
+        int producer = 7;
+        assert(enqueueCopy(&producer, sizeof(producer)));
+        item = (struct ShardedItem){.producer = -1, .sequence = -1};
+        assert(dequeueCopy(&item) == &item);
+        assert(item.producer == 7 && item.sequence == 0);
+
+        // Copies peek as NULL; a pointer queued the ordinary way passes through dequeueCopy and leaves the buffer alone
+        assert(enqueueCopy(&producer, sizeof(producer)));
+        void *peeked;
+        assert(peekN(&peeked, 1) == 1 && peeked == NULL);
+        assert(dequeueCopy(&item) == &item);
+        int plain = 0;
+        assert(enqueue(&plain));
+        item = (struct ShardedItem){.producer = -1, .sequence = -1};
+        assert(dequeueCopy(&item) == &plain);
+        assert(item.producer == -1 && item.sequence == -1);
+
+        // Any other dequeue hands the payload out as a heap copy
+        item = (struct ShardedItem){.producer = 2, .sequence = 3};
+        assert(enqueueCopy(&item, sizeof(item)));
+        struct ShardedItem *copy = (struct ShardedItem *)dequeue();
+        assert(copy != &item && copy->producer == 2 && copy->sequence == 3);
+        free(copy);
+
+        // Once closed and drained, dequeueCopy returns QUEUE_CLOSED instead of blocking
+        closeQueue();
+        assert(!enqueueCopy(&item, sizeof(item)));
+        assert(dequeueCopy(&item) == QUEUE_CLOSED);
+        destroyQueue();
+
+        // Copies still queued go with the queue, heap boxes of the lock-free path included; the sanitizer build reports any left behind
+        initQueueWithOpts(&modes[m]);
+        for (int i = 0; i < 4; i++)
+        {
+            item.sequence = i;
+            assert(enqueueCopy(&item, sizeof(item)));
+            assert(enqueue(&plain));
+        }
+        destroyQueue();
+    }
+
+    // SPSC copies live in the ring itself: pointers and copies interleave across segment boundaries, and copies peek as NULL
+    const struct queue_opts spsc = {.inline_size = sizeof(struct ShardedItem), .spsc = true};
+    initQueueWithOpts(&spsc);
+    int plain = 0;
+    for (int i = 0; i < 3 * MAX_SIZE; i++)
+    {
+        if (i % 2 == 0)
+        {
+            struct ShardedItem item = {.producer = 3, .sequence = i};
+            assert(enqueueCopy(&item, sizeof(item)));
+        }
+        else
+        {
+            assert(enqueue(&plain));
+        }
+    }
+    void *peeked[2];
+    assert(peekN(peeked, 2) == 2 && peeked[0] == NULL && peeked[1] == &plain);
+    for (int i = 0; i < 3 * MAX_SIZE; i++)
+    {
+        if (i % 2 == 0)
+        {
+            struct ShardedItem item;
+            assert(dequeueCopy(&item) == &item);
+            assert(item.producer == 3 && item.sequence == i);
+        }
+        else
+        {
+            assert(dequeue() == &plain);
+        }
+    }
+    assert(size() == 0);
+    destroyQueue();
+
+    printf("Inline payload test passed.\n");
+}
+
+void async_consumer_callback(void *item, void *ctx)
+{
+    struct AsyncLog *log = (struct AsyncLog *)ctx;
+    if (item == QUEUE_CLOSED)
+    {
+        log->closed++;
+        return;
+    }
+    if (item == NULL)
+    {
+        log->destroyed++;
+        return;
+    }
+    struct ShardedItem *sharded = (struct ShardedItem *)item;
+    log->seen[sharded->producer][sharded->sequence]++;
+    // Ask for the next item straight from the callback, like a coroutine looping on co_await
+    assert(dequeueAsync(async_consumer_callback, log));
+}
+
+void test_async_dequeue()
+{
+    printf("=== Testing dequeueAsync ===\n");
+
+    static struct AsyncLog log;
+    static struct ShardedItem items[NUM_SHARDS][MAX_SIZE];
+    for (int p = 0; p < NUM_SHARDS; p++)
+    {
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            items[p][i] = (struct ShardedItem){.producer = p, .sequence = i};
+        }
+    }
+    const struct queue_opts modes[] = {{0}, {.lock_free = true}, {.shards = NUM_SHARDS}, {.capacity = 16}};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        initQueueWithOpts(&modes[m]);
+        memset(&log, 0, sizeof(log));
+
+        // Many logical consumers wait without holding a thread
+        for (int c = 0; c < NUM_THREADS; c++)
+        {
+            assert(dequeueAsync(async_consumer_callback, &log));
+        }
+        assert(waiting() == 0);
+
+        // Producers complete them, and every item is delivered exactly once
+        thrd_t producers[NUM_SHARDS];
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            thrd_create(&producers[p], sharded_producer_thread, items[p]);
+        }
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            thrd_join(producers[p], NULL);
+        }
+        for (int p = 0; p < NUM_SHARDS; p++)
+        {
+            for (int i = 0; i < MAX_SIZE; i++)
+            {
+                assert(log.seen[p][i] == 1);
+            }
+        }
+        assert(size() == 0);
+
+        // Closing completes every consumer still waiting
+        assert(log.closed == 0);
+        closeQueue();
+        assert(log.closed == NUM_THREADS);
+        // A call on a closed, drained queue completes before it returns
+        assert(dequeueAsync(async_consumer_callback, &log));
+        assert(log.closed == NUM_THREADS + 1);
+        destroyQueue();
+    }
+
+    // An item that is already queued is handed over before dequeueAsync returns
+    initQueue();
+    memset(&log, 0, sizeof(log));
+    enqueue(&items[1][2]);
+    assert(dequeueAsync(async_consumer_callback, &log));
+    assert(log.seen[1][2] == 1);
+    // Destroying the queue completes pending calls with NULL
+    destroyQueue();
+    assert(log.destroyed == 1);
+
+    // With a single consumer thread, nobody else may complete a call
+    initQueueWithOpts(&(struct queue_opts){.spsc = true});
+    assert(!dequeueAsync(async_consumer_callback, &log));
+    destroyQueue();
+
+    printf("dequeueAsync test passed.\n");
+}
+
+int peeking_consumer_thread(void *arg)
+{
+    struct ShardedItem *items = (struct ShardedItem *)arg;
+    void *peeked[8];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        // Only this thread dequeues, so whatever it peeks is exactly what it takes next
+        size_t count = peekN(peeked, 8);
+        for (size_t k = 0; k < count; k++)
+        {
+            assert(peeked[k] == &items[i + k]);
+        }
+        struct ShardedItem *item = (struct ShardedItem *)dequeue();
+        assert(item == &items[i]);
+    }
+    return 0;
+}
+
+void test_peek()
+{
+    printf("=== Testing peek and peekN ===\n");
+
+    static struct ShardedItem items[MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        items[i] = (struct ShardedItem){.producer = 0, .sequence = i};
+    }
+    const struct queue_opts modes[] = {{0}, {.lock_free = true}, {.spsc = true}, {.shards = NUM_SHARDS}};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        initQueueWithOpts(&modes[m]);
+
+        void *item = NULL;
+        void *peeked[8];
+        assert(!peek(&item));
+        assert(peekN(peeked, 8) == 0);
+
+        // Peeking leaves the items, and their order, in place
+        for (int i = 0; i < 5; i++)
+        {
+            enqueue(&items[i]);
+        }
+        assert(peek(&item) && item == &items[0]);
+        assert(size() == 5);
+        assert(peekN(peeked, 3) == 3);
+        assert(peeked[0] == &items[0] && peeked[1] == &items[1] && peeked[2] == &items[2]);
+        assert(peekN(peeked, 8) == 5 && peeked[4] == &items[4]);
+        assert(peekN(peeked, 0) == 0);
+        for (int i = 0; i < 5; i++)
+        {
+            assert(dequeue() == &items[i]);
+        }
+        assert(!peek(&item));
+
+        // A consumer peeking ahead while the producer runs always sees the items it is about to take
+        thrd_t producer;
+        thrd_t consumer;
+        thrd_create(&consumer, peeking_consumer_thread, items);
+        thrd_create(&producer, sharded_producer_thread, items);
+        thrd_join(producer, NULL);
+        thrd_join(consumer, NULL);
+        assert(size() == 0);
+
+        destroyQueue();
+    }
+
+    // Priorities peek in the order they dequeue, and caller-owned links as themselves
+    initQueue();
+    struct LinkedItem linked = {.value = 1};
+    enqueue(&items[0]);
+    enqueueNode(&linked.link);
+    enqueuePriority(&items[2], 2);
+    void *peeked[4];
+    assert(peekN(peeked, 4) == 3);
+    assert(peeked[0] == &items[2] && peeked[1] == &items[0] && peeked[2] == &linked.link);
+    assert(dequeue() == &items[2]);
+    assert(dequeue() == &items[0]);
+    assert(dequeueNode() == &linked.link);
+    destroyQueue();
+
+    // Long lock-free peeks racing several consumers still return, with a snapshot of queued items
+    initQueueWithOpts(&(struct queue_opts){.lock_free = true});
+    for (int i = 0; i < 20 * MAX_SIZE; i++)
+    {
+        enqueue(&items[i % MAX_SIZE]);
+    }
+    atomic_int taken = 0;
+    thrd_t consumers[4];
+    for (int t = 0; t < 4; t++)
+    {
+        thrd_create(&consumers[t], racing_consumer_thread, &taken);
+    }
+    static void *window[MAX_SIZE];
+    while (size() > 0)
+    {
+        size_t count = peekN(window, MAX_SIZE);
+        assert(count <= MAX_SIZE);
+        for (size_t k = 0; k < count; k++)
+        {
+            assert((struct ShardedItem *)window[k] >= items && (struct ShardedItem *)window[k] < items + MAX_SIZE);
+        }
+    }
+    closeQueue();
+    for (int t = 0; t < 4; t++)
+    {
+        thrd_join(consumers[t], NULL);
+    }
+    assert(taken == 20 * MAX_SIZE);
+    destroyQueue();
+
+    printf("Peek test passed.\n");
+}
+
 int main()
 {
     test_destroyQueue();
@@ -545,6 +2671,36 @@ int main()
     test_enqueue_dequeue_with_sleep();
     test_edge_cases();
     test_mixed_operations();
+    test_lock_free_enqueue_dequeue();
+    test_lock_free_fifo_order();
+    test_node_pool_reuse();
+    test_multiple_queues();
+    test_batch_enqueue_dequeue();
+    test_blocking_dequeue_many();
+    test_spurious_wakeups_keep_place();
+    test_spin_then_park();
+    test_dequeue_until();
+    test_per_thread_stats();
+    test_bounded_queue();
+    test_queue_stats();
+    test_sharded_queue();
+    test_priority_lanes();
+    test_targeted_wakeups();
+    test_intrusive_nodes();
+    test_close_queue();
+    test_spsc_queue();
+    test_direct_handoff();
+    test_sequence_wraparound();
+    test_pollable_queue();
+    test_drain_queue();
+    test_numa_sharded_queue();
+    test_barging_policy();
+#ifdef QUEUE_HAVE_SHM
+    test_shared_memory_queue();
+#endif
+    test_inline_payload_queue();
+    test_async_dequeue();
+    test_peek();
 
     return 0;
 }
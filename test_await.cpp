@@ -0,0 +1,146 @@
+// Tests for queue_await.hpp. queue.c is C11, so it is built on its own and linked in:
+//     gcc -std=c11 -O2 -c queue.c -o queue.o && g++ -std=c++20 -O2 -o test_await test_await.cpp queue.o && ./test_await
+#include <cassert>
+#include <cstdio>
+#include <coroutine>
+#include <thread>
+#include "queue_await.hpp"
+
+// A coroutine that starts at once and frees itself when it finishes; the tests watch it through the state they hand it.
+struct detached_task
+{
+    struct promise_type
+    {
+        detached_task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+// What an awaiting coroutine saw: the items it got, in order, and the thread it was running on after each resume.
+struct AwaitLog
+{
+    void *items[4] = {};
+    std::thread::id resumed_on[4];
+    int count = 0;
+    bool done = false;
+};
+
+// Awaits up to limit items, stopping early once the queue reports QUEUE_CLOSED or NULL.
+detached_task await_items(queue_t *q, AwaitLog *log, int limit)
+{
+    while (log->count < limit)
+    {
+        void *item = co_await queue_next(q);
+        log->items[log->count] = item;
+        log->resumed_on[log->count] = std::this_thread::get_id();
+        log->count++;
+        if (item == QUEUE_CLOSED || item == nullptr)
+        {
+            break;
+        }
+    }
+    log->done = true;
+}
+
+void test_resume_on_producer()
+{
+    printf("=== Testing co_await resuming on the producer ===\n");
+
+    queue_t *q = queue_create(nullptr);
+    AwaitLog log;
+    await_items(q, &log, 1);
+    // Nothing is queued, so the coroutine is suspended and this thread carries on
+    assert(log.count == 0 && !log.done);
+
+    int item = 1;
+    std::thread::id producer_id;
+    std::thread producer([&] {
+        producer_id = std::this_thread::get_id();
+        assert(queue_enqueue(q, &item));
+    });
+    producer.join();
+    // The enqueue completed the waiter, so the coroutine ran to the end inside it
+    assert(log.done && log.count == 1);
+    assert(log.items[0] == &item);
+    assert(log.resumed_on[0] == producer_id);
+    assert(log.resumed_on[0] != std::this_thread::get_id());
+
+    // An item that is already queued is taken without suspending
+    AwaitLog ready;
+    assert(queue_enqueue(q, &item));
+    await_items(q, &ready, 1);
+    assert(ready.done && ready.items[0] == &item);
+    assert(ready.resumed_on[0] == std::this_thread::get_id());
+
+    queue_destroy(q);
+
+    printf("co_await producer resume test passed.\n");
+}
+
+void test_spsc_await()
+{
+    printf("=== Testing co_await on an SPSC queue ===\n");
+
+    queue_opts opts = {};
+    opts.spsc = true;
+    queue_t *q = queue_create(&opts);
+
+    // The queue refuses asynchronous waiters, so await_suspend returns false and the coroutine carries on at once with NULL
+    AwaitLog log;
+    await_items(q, &log, 1);
+    assert(log.done && log.count == 1);
+    assert(log.items[0] == nullptr);
+    assert(log.resumed_on[0] == std::this_thread::get_id());
+
+    // A queued item is still taken in await_ready
+    int item = 2;
+    assert(queue_enqueue(q, &item));
+    AwaitLog ready;
+    await_items(q, &ready, 1);
+    assert(ready.done && ready.items[0] == &item);
+
+    queue_destroy(q);
+
+    printf("co_await SPSC test passed.\n");
+}
+
+void test_await_closed()
+{
+    printf("=== Testing co_await on a closed queue ===\n");
+
+    // Items queued before the close are drained first, and only then does co_await evaluate to QUEUE_CLOSED
+    queue_t *q = queue_create(nullptr);
+    int items[2] = {3, 4};
+    assert(queue_enqueue(q, &items[0]));
+    assert(queue_enqueue(q, &items[1]));
+    queue_close(q);
+    AwaitLog drained;
+    await_items(q, &drained, 4);
+    assert(drained.done && drained.count == 3);
+    assert(drained.items[0] == &items[0] && drained.items[1] == &items[1]);
+    assert(drained.items[2] == QUEUE_CLOSED);
+    queue_destroy(q);
+
+    // A coroutine suspended on an empty queue is resumed by the close itself
+    q = queue_create(nullptr);
+    AwaitLog parked;
+    await_items(q, &parked, 1);
+    assert(!parked.done);
+    queue_close(q);
+    assert(parked.done && parked.count == 1);
+    assert(parked.items[0] == QUEUE_CLOSED);
+    queue_destroy(q);
+
+    printf("co_await closed queue test passed.\n");
+}
+
+int main()
+{
+    test_resume_on_producer();
+    test_spsc_await();
+    test_await_closed();
+    return 0;
+}